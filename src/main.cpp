@@ -12,9 +12,20 @@
 #include <SDL.h>
 #include <vector>
 #include <array>
-#include <list>
+#include <unordered_map>
 #include <iostream>
 #include <utility>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <climits>
+#include <cfloat>
+#include <algorithm>
+#include <functional>
+
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
 
 #define SINE_WAVE 0
 #define SQUARE_WAVE 1
@@ -23,152 +34,709 @@
 #define ANALOG_SAW 4
 #define NOISE 5
 
+#define QUALITY_LIVE 0 // Renders at the device rate.
+#define QUALITY_HIGH 1 // Renders at 2x the device rate.
+#define QUALITY_OFFLINE 2 // Renders at 4x the device rate.
+
 #define NUM_OF_KEYS 16
+#define MAX_NUM_OF_KEYS 128
+#define MAX_NUM_OF_MANUALS 4
+#define MAX_NUM_OF_CHANNELS 8
+#define STEAL_FADE_TIME 0.005 // Seconds a stolen voice takes to fade out, so stealing does not click.
+#define GAIN_REDUCTION_LOG_INTERVAL 1000 // Milliseconds between reports of the output limiter gain reduction while it is active.
+#define DEFAULT_BLOCK_SIZE 512 // Audio callback size in frames requested from the device.
 	
 SDL_Window* window = nullptr;
 SDL_Surface* surface = nullptr;
 SDL_Renderer* gRenderer = nullptr;
 
-std::list<std::pair<SDL_FingerID,int>> touches;
+std::unordered_map<SDL_FingerID, int> touches; // Key held by each finger, -1 while a finger is between keys.
+int m_nMouseKey = -1; // Key held by the left mouse button.
+
+int m_nNumOfKeys = NUM_OF_KEYS; // Keys per manual.
+int m_nNumOfManuals = 1;
+int m_nLowestNote = 0; // Note of the first key of each manual, in semitones from middle C. -39 is A0 on an 88 key piano.
+unsigned m_nQualityPreset = QUALITY_LIVE;
+int m_nVoiceBudget = 32; // Voices shared by all parts.
+int m_nNumOfChannels = 2; // Requested from the audio device, which may pick another layout.
+bool m_bLayerPad = false; // Layer a pad part over every manual.
+bool m_bSplitKeyboard = false; // Play a pad part below m_nSplitNote on every manual.
+int m_nSplitNote = 0;
+
+std::vector<SDL_Rect> m_PianoKeys; // Keys of all manuals, manual by manual.
+std::vector<bool> m_bIsKeyPressed;
+std::vector<bool> m_bIsKeyDrawn; // Key states currently shown in m_KeyboardTexture.
+std::vector<int> m_nKeyHolds; // Number of fingers or mouse buttons holding each key.
 
-std::array<SDL_Rect, NUM_OF_KEYS> m_PianoKeys;
-std::array<bool, NUM_OF_KEYS> m_bIsKeyPressed;
-int m_nNumofWhiteKeys = 0;
+std::vector<int> m_WhiteKeyColumns; // Key of a manual under each pixel along the keyboard, -1 for gaps. Used by HitTest.
+std::vector<int> m_BlackKeyColumns;
+double m_dManualSize = 0.0; // Size of one manual across the keyboard in pixels.
 
-bool IsKeyWhite(int nKey)
+SDL_Texture* m_KeyboardTexture = nullptr; // Cached keyboard image. Null if the renderer has no render target support.
+bool m_bRedrawKeyboard = true; // Set when the whole keyboard has to be repainted, e.g. after a layout change.
+
+Uint32 m_nNoiseState = 1; // Xorshift state of the noise waveform. Not rand(), so renders match on every platform.
+
+void SeedNoise(const Uint32& nSeed)
 {
-	nKey %= 12;
-	if (nKey == 0 || nKey == 2 || nKey == 4 || nKey == 5 || nKey == 7 || nKey == 9 || nKey == 11)
-		return true;
-	else
-		return false;
+	m_nNoiseState = nSeed != 0 ? nSeed : 1;
+}
+
+// Uniform noise in the range -1.0 - 1.0
+double NoiseSample()
+{
+	m_nNoiseState ^= m_nNoiseState << 13;
+	m_nNoiseState ^= m_nNoiseState >> 17;
+	m_nNoiseState ^= m_nNoiseState << 5;
+	return m_nNoiseState * (2.0 / 4294967295.0) - 1.0;
 }
 
-bool IsBlackKeySkip(int nKey)
+bool IsKeyWhite(int nNote)
 {
-	nKey %= 12;
-	if (nKey == 3 || nKey == 10)
+	nNote = ((nNote % 12) + 12) % 12;
+	if (nNote == 0 || nNote == 2 || nNote == 4 || nNote == 5 || nNote == 7 || nNote == 9 || nNote == 11)
 		return true;
 	else
 		return false;
 }
 
+// Note played by a key, in semitones from middle C.
+int KeyNote(const int& nKey)
+{
+	return m_nLowestNote + nKey % m_nNumOfKeys;
+}
+
+void InitKeyboard()
+{
+	const int nTotalKeys = m_nNumOfKeys * m_nNumOfManuals;
+	m_PianoKeys.assign(nTotalKeys, SDL_Rect({ 0, 0, 0, 0 }));
+	m_bIsKeyPressed.assign(nTotalKeys, false);
+	m_bIsKeyDrawn.assign(nTotalKeys, false);
+	m_nKeyHolds.assign(nTotalKeys, 0);
+}
+
+// Maps a rect given along (dLong) and across (dCross) the keyboard to window coordinates.
+// Desktop keyboards run left to right with black keys at the top, Android keyboards run top to bottom with black keys on the right.
+SDL_Rect KeyRect(const int& nManual, const double& dLong, const double& dLongSize, const double& dCross, const double& dCrossSize)
+{
+#ifdef __ANDROID__
+	return SDL_Rect({ (int)(m_dManualSize * (nManual + 1) - dCross - dCrossSize), (int)dLong, (int)dCrossSize, (int)dLongSize });
+#else
+	return SDL_Rect({ (int)dLong, (int)(m_dManualSize * nManual + dCross), (int)dLongSize, (int)dCrossSize });
+#endif
+}
+
 void CalculateLayout()
 {	
-	if (window != nullptr)
+	if (window != nullptr && !m_PianoKeys.empty())
 	{
 		int width, height;
 		SDL_GetWindowSize(window, &width, &height);
-		
 #ifdef __ANDROID__
-		int j = 0;
-		for (int i = 0; i < m_PianoKeys.size(); ++i)
-		{
-			if (IsKeyWhite(i)) // White Keys
-			{
-				m_PianoKeys[i] = SDL_Rect({ (width / 100),
-											(height / 300) + (height / m_nNumofWhiteKeys * j),
-											width - (width / 100 * 2) ,
-											height / m_nNumofWhiteKeys - (height / 300 * 2) });
-				++j;
-			}			
-		}
-		j = 0;
-		for (int i = 0; i < m_PianoKeys.size(); ++i)
-		{
-			if (!IsKeyWhite(i))
-			{
-				m_PianoKeys[i] = SDL_Rect({ (width / 3) - (width / 100),
-											(height / 300) + (height / m_nNumofWhiteKeys * j) + ((int)((height / m_nNumofWhiteKeys - (height / 300 * 2)) / 1.5)),
-											width - (width / 3) ,
-											(int)((height / m_nNumofWhiteKeys - (height / 300 * 2)) / 1.5) });
-				if (IsBlackKeySkip(i)) j += 2;
-				else ++j;
-			}
-		}
-#else	
-		int j = 0;
-		for (int i = 0; i < m_PianoKeys.size(); ++i)
-		{
-			if (IsKeyWhite(i)) // White Keys
-			{
-				m_PianoKeys[i] = SDL_Rect({ (width / 300) + (width / m_nNumofWhiteKeys * j),
-											(height / 100) ,
-											width / m_nNumofWhiteKeys - (width / 300 * 2),
-											height - (height / 100 * 2) });
-			++j;
-			}
-		}
-		j = 0;
-		for (int i = 0; i < m_PianoKeys.size(); ++i)
+		const int nLength = height;
+		m_dManualSize = (double)width / m_nNumOfManuals;
+#else
+		const int nLength = width;
+		m_dManualSize = (double)height / m_nNumOfManuals;
+#endif
+		int nNumOfWhiteKeys = 0;
+		for (int i = 0; i < m_nNumOfKeys; ++i)
+			if (IsKeyWhite(KeyNote(i)))
+				++nNumOfWhiteKeys;
+
+		const double dWhiteStep = (double)nLength / SDL_max(nNumOfWhiteKeys, 1);
+		const double dGap = nLength / 300.0;
+		const double dMargin = m_dManualSize / 100.0;
+		const double dWhiteSize = dWhiteStep - dGap * 2.0;
+		const double dBlackSize = dWhiteSize / 1.5;
+
+		m_WhiteKeyColumns.assign(nLength, -1);
+		m_BlackKeyColumns.assign(nLength, -1);
+
+		int nWhiteKeysBefore = 0;
+		for (int i = 0; i < m_nNumOfKeys; ++i)
 		{
-			if (!IsKeyWhite(i)) // White Keys
+			const bool bIsWhite = IsKeyWhite(KeyNote(i));
+			// Black keys straddle the gap after the preceding white key.
+			const double dLong = bIsWhite ? dGap + dWhiteStep * nWhiteKeysBefore : dGap + dWhiteStep * (nWhiteKeysBefore - 1) + dBlackSize;
+
+			for (int nManual = 0; nManual < m_nNumOfManuals; ++nManual)
 			{
-				m_PianoKeys[i] = SDL_Rect({ (width / 300) + (width / m_nNumofWhiteKeys * j) + ((int)((width / m_nNumofWhiteKeys - (width / 300 * 2)) / 1.5) ),
-											(height / 100) ,
-											(int)((width / m_nNumofWhiteKeys - (width / 300 * 2))/1.5),
-											height - (height / 3) });
-				if (IsBlackKeySkip(i)) j += 2;
-				else ++j;
+				if (bIsWhite)
+					m_PianoKeys[nManual * m_nNumOfKeys + i] = KeyRect(nManual, dLong, dWhiteSize, dMargin, m_dManualSize - dMargin * 2.0);
+				else
+					m_PianoKeys[nManual * m_nNumOfKeys + i] = KeyRect(nManual, dLong, dBlackSize, dMargin, m_dManualSize * 2.0 / 3.0);
 			}
+
+			std::vector<int>& columns = bIsWhite ? m_WhiteKeyColumns : m_BlackKeyColumns;
+			for (int nColumn = SDL_max((int)dLong, 0); nColumn < SDL_min((int)(dLong + (bIsWhite ? dWhiteSize : dBlackSize)), nLength); ++nColumn)
+				columns[nColumn] = i;
+
+			if (bIsWhite)
+				++nWhiteKeysBefore;
 		}
-#endif
 	}
 }
 
-void DrawKeys()
+void CreateKeyboardTexture()
+{
+	if (m_KeyboardTexture != nullptr)
+	{
+		SDL_DestroyTexture(m_KeyboardTexture);
+		m_KeyboardTexture = nullptr;
+	}
+
+	int width, height;
+	if (SDL_RenderTargetSupported(gRenderer) && SDL_GetRendererOutputSize(gRenderer, &width, &height) == 0)
+		m_KeyboardTexture = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, width, height);
+
+	if (m_KeyboardTexture == nullptr)
+		SDL_Log("Warning: Keyboard texture not created, redrawing the whole keyboard on every change. SDL_Error: %s", SDL_GetError());
+
+	m_bRedrawKeyboard = true;
+}
+
+void FillKeys(const std::vector<SDL_Rect>& keys, const Uint8 r, const Uint8 g, const Uint8 b)
+{
+	if (!keys.empty())
+	{
+		SDL_SetRenderDrawColor(gRenderer, r, g, b, 0xFF);
+		SDL_RenderFillRects(gRenderer, keys.data(), (int)keys.size());
+	}
+}
+
+// Repaints keys whose pressed state changed since the last call. Returns false if nothing changed and there is nothing to present.
+bool DrawKeys()
 {
+	static std::vector<SDL_Rect> whiteKeys, whitePressedKeys, blackKeys, blackPressedKeys;
+	static std::vector<bool> bIsKeyDirty;
+	bIsKeyDirty.resize(m_PianoKeys.size());
+
+	bool bIsAnyKeyDirty = false;
+	for (unsigned int i = 0; i < m_PianoKeys.size(); ++i)
+	{
+		bIsKeyDirty[i] = m_bRedrawKeyboard || m_bIsKeyPressed[i] != m_bIsKeyDrawn[i];
+		bIsAnyKeyDirty |= bIsKeyDirty[i];
+	}
+
+	if (!bIsAnyKeyDirty)
+		return false;
+
+	// Without a cached texture the back buffer contents are undefined after presenting, so everything is drawn.
+	bool bFullRedraw = m_bRedrawKeyboard || m_KeyboardTexture == nullptr;
+
 	for (unsigned int i = 0; i < m_PianoKeys.size(); ++i)
 	{
-		if (IsKeyWhite(i))
+		if (bFullRedraw)
+			bIsKeyDirty[i] = true;
+		else if (bIsKeyDirty[i] && IsKeyWhite(KeyNote(i))) // Repainting a white key covers the black keys overlapping it.
 		{
-			if (m_bIsKeyPressed[i])
-				SDL_SetRenderDrawColor(gRenderer, 0xAA, 0xAA, 0xAA, 0xFF);
-			else
-				SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-				
-			SDL_RenderFillRect(gRenderer, &m_PianoKeys[i]);
+			if (i % m_nNumOfKeys > 0 && !IsKeyWhite(KeyNote(i - 1)))
+				bIsKeyDirty[i - 1] = true;
+			if ((i + 1) % m_nNumOfKeys > 0 && !IsKeyWhite(KeyNote(i + 1)))
+				bIsKeyDirty[i + 1] = true;
 		}
-	}	
-	
+	}
+
+	whiteKeys.clear(); whitePressedKeys.clear(); blackKeys.clear(); blackPressedKeys.clear();
+
 	for (unsigned int i = 0; i < m_PianoKeys.size(); ++i)
 	{
-		if (!IsKeyWhite(i))
+		if (bIsKeyDirty[i])
 		{
-			if (m_bIsKeyPressed[i])
-				SDL_SetRenderDrawColor(gRenderer, 0xAA, 0xAA, 0xAA, 0xFF);
+			if (IsKeyWhite(KeyNote(i)))
+				(m_bIsKeyPressed[i] ? whitePressedKeys : whiteKeys).push_back(m_PianoKeys[i]);
 			else
-				SDL_SetRenderDrawColor(gRenderer, 0x00, 0x00, 0x00, 0xFF);
-
-			SDL_RenderFillRect(gRenderer, &m_PianoKeys[i]);
+				(m_bIsKeyPressed[i] ? blackPressedKeys : blackKeys).push_back(m_PianoKeys[i]);
 		}
 	}
+
+	if (m_KeyboardTexture != nullptr)
+		SDL_SetRenderTarget(gRenderer, m_KeyboardTexture);
+
+	if (bFullRedraw)
+	{
+		SDL_SetRenderDrawColor(gRenderer, 0x88, 0x88, 0x88, 0xFF);
+		SDL_RenderClear(gRenderer);
+	}
+
+	// White keys first so black keys end up on top.
+	FillKeys(whiteKeys, 0xFF, 0xFF, 0xFF);
+	FillKeys(whitePressedKeys, 0xAA, 0xAA, 0xAA);
+	FillKeys(blackKeys, 0x00, 0x00, 0x00);
+	FillKeys(blackPressedKeys, 0xAA, 0xAA, 0xAA);
+
+	if (m_KeyboardTexture != nullptr)
+	{
+		SDL_SetRenderTarget(gRenderer, nullptr);
+		SDL_RenderCopy(gRenderer, m_KeyboardTexture, nullptr, nullptr);
+	}
+
+	m_bIsKeyDrawn = m_bIsKeyPressed;
+	m_bRedrawKeyboard = false;
+
+	return true;
+}
+
+bool IsInsideKey(const int& x, const int& y, const SDL_Rect& key)
+{
+	return x > key.x && x < (key.x + key.w) && y > key.y && y < (key.y + key.h);
 }
 
+// Returns the key under a window position or -1. Looks up the black and white key at that column instead of scanning all keys.
 int HitTest(const int & x, const int & y)
 {
-	for (int i = 0; i < m_PianoKeys.size(); ++i)
+#ifdef __ANDROID__
+	const int nColumn = y;
+	const int nManual = (int)(x / m_dManualSize);
+#else
+	const int nColumn = x;
+	const int nManual = (int)(y / m_dManualSize);
+#endif
+	if (nColumn < 0 || nColumn >= (int)m_WhiteKeyColumns.size() || nManual < 0 || nManual >= m_nNumOfManuals)
+		return -1;
+
+	const int nBlackKey = m_BlackKeyColumns[nColumn];
+	if (nBlackKey != -1 && IsInsideKey(x, y, m_PianoKeys[nManual * m_nNumOfKeys + nBlackKey]))
+		return nManual * m_nNumOfKeys + nBlackKey;
+
+	const int nWhiteKey = m_WhiteKeyColumns[nColumn];
+	if (nWhiteKey != -1 && IsInsideKey(x, y, m_PianoKeys[nManual * m_nNumOfKeys + nWhiteKey]))
+		return nManual * m_nNumOfKeys + nWhiteKey;
+
+	return -1;
+}
+
+SDL_AudioDeviceID device;
+
+// Sum of pA[i] * pB[i]. Uses SSE2 where available.
+inline double DotProduct(const double* pA, const double* pB, const int& nLength)
+{
+	int i = 0;
+	double dSum = 0.0;
+#if defined(__SSE2__)
+	__m128d sum0 = _mm_setzero_pd();
+	__m128d sum1 = _mm_setzero_pd();
+	for (; i + 4 <= nLength; i += 4)
+	{
+		sum0 = _mm_add_pd(sum0, _mm_mul_pd(_mm_loadu_pd(pA + i), _mm_loadu_pd(pB + i)));
+		sum1 = _mm_add_pd(sum1, _mm_mul_pd(_mm_loadu_pd(pA + i + 2), _mm_loadu_pd(pB + i + 2)));
+	}
+	double dLanes[2];
+	_mm_storeu_pd(dLanes, _mm_add_pd(sum0, sum1));
+	dSum = dLanes[0] + dLanes[1];
+#endif
+	for (; i < nLength; ++i)
+		dSum += pA[i] * pB[i];
+	return dSum;
+}
+
+// pDst[i] += pSrc[i] * dGain. Uses SSE2 where available.
+inline void MixInto(double* pDst, const double* pSrc, const int& nSamples, const double& dGain)
+{
+	int i = 0;
+#if defined(__SSE2__)
+	const __m128d gain = _mm_set1_pd(dGain);
+	for (; i + 2 <= nSamples; i += 2)
+		_mm_storeu_pd(pDst + i, _mm_add_pd(_mm_loadu_pd(pDst + i), _mm_mul_pd(_mm_loadu_pd(pSrc + i), gain)));
+#endif
+	for (; i < nSamples; ++i)
+		pDst[i] += pSrc[i] * dGain;
+}
+
+// Constant power gains of a source at dPan (-1.0 left, 1.0 right) for each of nChannels device channels.
+// Mono devices get the source at full level. Wider layouts pan between their front left and right channels, the rest stay silent.
+void PanGains(const double& dPan, const int& nChannels, double* pGains)
+{
+	for (int c = 0; c < nChannels; ++c)
+		pGains[c] = 0.0;
+
+	if (nChannels == 1)
+		pGains[0] = 1.0;
+	else
+	{
+		double dAngle = (SDL_max(-1.0, SDL_min(dPan, 1.0)) + 1.0) * M_PI / 4.0;
+		pGains[0] = cos(dAngle);
+		pGains[1] = sin(dAngle);
+	}
+}
+
+class HalfbandDecimator // Halves the sample rate of a signal with a Kaiser windowed halfband FIR.
+{
+	// The filter is split into its two polyphase branches. Every odd tap except the centre one is zero,
+	// so the odd branch is a plain delay and only the even branch needs a convolution.
+	std::vector<double> m_dEvenTaps;
+	std::vector<double> m_dEvenHistory; // Previous even branch input followed by the current block.
+	std::vector<double> m_dOddHistory; // Previous odd branch input followed by the current block.
+	int m_nOddDelay;
+
+	static double BesselI0(const double& dX);
+
+public:
+	// nTaps must be of the form 4k + 3. dKaiserBeta trades transition width against stopband attenuation.
+	HalfbandDecimator(const int& nTaps, const double& dKaiserBeta);
+
+	void Reset();
+	// Makes room for blocks of up to nMaxOutFrames, so Process does not allocate.
+	void Reserve(const int& nMaxOutFrames);
+	// Reads nOutFrames * 2 samples from pIn and writes nOutFrames samples to pOut. pIn and pOut may be the same buffer.
+	void Process(const double* pIn, double* pOut, const int& nOutFrames);
+};
+
+HalfbandDecimator::HalfbandDecimator(const int& nTaps, const double& dKaiserBeta)
+	: m_nOddDelay((nTaps + 1) / 4)
+{
+	const int nCentre = (nTaps - 1) / 2;
+	double dSum = 0.0;
+
+	for (int n = 0; n < nTaps; n += 2)
+	{
+		double dX = 0.5 * (n - nCentre);
+		double dRatio = 2.0 * n / (nTaps - 1) - 1.0;
+		double dTap = 0.5 * sin(M_PI * dX) / (M_PI * dX) * BesselI0(dKaiserBeta * sqrt(1.0 - dRatio * dRatio)) / BesselI0(dKaiserBeta);
+		m_dEvenTaps.push_back(dTap);
+		dSum += dTap;
+	}
+	// The centre tap is 0.5, scale the rest so that DC passes at unity gain.
+	for (auto& dTap : m_dEvenTaps)
+		dTap *= 0.5 / dSum;
+
+	Reset();
+}
+
+double HalfbandDecimator::BesselI0(const double& dX)
+{
+	double dSum = 1.0, dTerm = 1.0;
+	for (int k = 1; k < 50 && dTerm > dSum * 1e-16; ++k)
+	{
+		dTerm *= (dX * dX / 4.0) / (k * k);
+		dSum += dTerm;
+	}
+	return dSum;
+}
+
+void HalfbandDecimator::Reset()
+{
+	m_dEvenHistory.assign(m_dEvenTaps.size() - 1, 0.0);
+	m_dOddHistory.assign(m_nOddDelay, 0.0);
+}
+
+void HalfbandDecimator::Reserve(const int& nMaxOutFrames)
+{
+	m_dEvenHistory.reserve(m_dEvenTaps.size() - 1 + nMaxOutFrames);
+	m_dOddHistory.reserve(m_nOddDelay + nMaxOutFrames);
+}
+
+void HalfbandDecimator::Process(const double* pIn, double* pOut, const int& nOutFrames)
+{
+	const int nEvenHistory = (int)m_dEvenTaps.size() - 1;
+
+	m_dEvenHistory.resize(nEvenHistory + nOutFrames);
+	m_dOddHistory.resize(m_nOddDelay + nOutFrames);
+
+	for (int i = 0; i < nOutFrames; ++i)
+	{
+		m_dEvenHistory[nEvenHistory + i] = pIn[i * 2];
+		m_dOddHistory[m_nOddDelay + i] = pIn[i * 2 + 1];
+	}
+
+	// The taps are symmetric, so the window does not need to be reversed.
+	for (int i = 0; i < nOutFrames; ++i)
+		pOut[i] = DotProduct(m_dEvenTaps.data(), &m_dEvenHistory[i], nEvenHistory + 1) + 0.5 * m_dOddHistory[i];
+
+	m_dEvenHistory.erase(m_dEvenHistory.begin(), m_dEvenHistory.begin() + nOutFrames);
+	m_dOddHistory.erase(m_dOddHistory.begin(), m_dOddHistory.begin() + nOutFrames);
+}
+
+class OutputStage // Turns the mixed voices into device samples: look-ahead peak limiter, soft clipper and TPDF dither.
+{
+	double m_dLookaheadTime;
+	double m_dCeiling;
+	double m_dReleaseTime;
+	double m_dSoftClipKnee;
+
+	int m_nSampleRate;
+	int m_nChannels;
+	int m_nLookahead; // Frames. The limiter gain is the running minimum over this many frames, smoothed by a box filter of the same length.
+	double m_dReleaseCoefficient;
+	double m_dGain;
+	double m_dBoxSum;
+	Uint64 m_nFrame;
+	Uint32 m_nDitherState;
+
+	std::vector<double> m_dDelay; // m_nLookahead - 1 frames of input, so the gain has settled by the time a peak is output.
+	std::vector<double> m_dBox;
+	std::vector<double> m_dMinValues; // Monotonic queue of the smallest gains in the look-ahead window.
+	std::vector<Uint64> m_nMinFrames;
+	int m_nMinHead;
+	int m_nMinCount;
+	std::vector<double> m_dScratch;
+	std::vector<double> m_dDither;
+	int m_nMaxFrames;
+
+	double m_dBlockGainReduction;
+	std::atomic<double> m_dMaxGainReduction;
+
+	void Prepare();
+	double LimiterGain(const double& dPeak);
+
+public:
+	OutputStage();
+
+	void SetFormat(const int& nSampleRate, const int& nChannels);
+	// Largest block Process is called with, so it does not allocate on the audio thread.
+	void SetBufferSize(const int& nMaxFrames);
+	// Look-ahead time, adds the same amount of output latency. Range double 0.0 - 0.02 seconds.
+	void SetLookaheadTime(const double& dNewTime);
+	// Highest peak the limiter lets through. Range double 0.1 - 1.0
+	void SetCeiling(const double& dNewCeiling);
+	// Time for the gain to recover after a peak. Range double 0.001 - 2.0 seconds.
+	void SetReleaseTime(const double& dNewTime);
+	// Level above which samples are smoothly saturated towards full scale. Range double 0.5 - 1.0
+	void SetSoftClipKnee(const double& dNewKnee);
+
+	// Processes nFrames interleaved frames of the mix into pOut.
+	void Process(const double* pIn, Sint16* pOut, const int& nFrames);
+	// Largest gain reduction in dB since the previous call. Can be called from any thread.
+	double TakeGainReduction();
+	// Largest gain reduction in dB during the last Process call. Audio thread only.
+	double GetBlockGainReduction() const { return m_dBlockGainReduction; }
+};
+
+OutputStage::OutputStage()
+	: m_dLookaheadTime(0.002), m_dCeiling(0.9), m_dReleaseTime(0.1), m_dSoftClipKnee(0.8), m_nSampleRate(44100), m_nChannels(1), m_nDitherState(0x12345678), m_nMaxFrames(DEFAULT_BLOCK_SIZE), m_dBlockGainReduction(0.0), m_dMaxGainReduction(0.0)
+{
+	Prepare();
+}
+
+void OutputStage::Prepare()
+{
+	m_nLookahead = SDL_max(1, (int)(m_dLookaheadTime * m_nSampleRate));
+	m_dReleaseCoefficient = 1.0 - exp(-1.0 / (m_dReleaseTime * m_nSampleRate));
+	m_dGain = 1.0;
+	m_dBoxSum = m_nLookahead;
+	m_nFrame = 0;
+
+	m_dDelay.assign((m_nLookahead - 1) * m_nChannels, 0.0);
+	m_dBox.assign(m_nLookahead, 1.0);
+	m_dMinValues.assign(m_nLookahead, 1.0);
+	m_nMinFrames.assign(m_nLookahead, 0);
+	m_nMinHead = 0;
+	m_nMinCount = 0;
+
+	if ((int)m_dScratch.size() < m_nMaxFrames * m_nChannels)
+	{
+		m_dScratch.resize(m_nMaxFrames * m_nChannels);
+		m_dDither.resize(m_nMaxFrames * m_nChannels);
+	}
+}
+
+double OutputStage::LimiterGain(const double& dPeak)
+{
+	double dTarget = dPeak > m_dCeiling ? m_dCeiling / dPeak : 1.0;
+
+	// Expire the gain that left the window, drop queued gains that can no longer be the minimum and push the new one.
+	if (m_nMinCount > 0 && m_nMinFrames[m_nMinHead] + m_nLookahead <= m_nFrame)
+	{
+		m_nMinHead = (m_nMinHead + 1) % m_nLookahead;
+		--m_nMinCount;
+	}
+	while (m_nMinCount > 0 && m_dMinValues[(m_nMinHead + m_nMinCount - 1) % m_nLookahead] >= dTarget)
+		--m_nMinCount;
+	m_dMinValues[(m_nMinHead + m_nMinCount) % m_nLookahead] = dTarget;
+	m_nMinFrames[(m_nMinHead + m_nMinCount) % m_nLookahead] = m_nFrame;
+	++m_nMinCount;
+
+	// Release smoothing never raises the gain above the held minimum, and the box filter reaches that minimum by the time the peak leaves the delay.
+	m_dGain = SDL_min(m_dMinValues[m_nMinHead], m_dGain + (1.0 - m_dGain) * m_dReleaseCoefficient);
+
+	const int nBox = (int)(m_nFrame % m_nLookahead);
+	m_dBoxSum += m_dGain - m_dBox[nBox];
+	m_dBox[nBox] = m_dGain;
+	++m_nFrame;
+
+	return m_dBoxSum / m_nLookahead;
+}
+
+// Saturates samples above dKnee towards full scale with a curve that has unity slope at the knee.
+inline void SoftClip(double* pSamples, const int& nSamples, const double& dKnee)
+{
+	int i = 0;
+	const double dRange = 1.0 - dKnee;
+#if defined(__SSE2__)
+	const __m128d signMask = _mm_set1_pd(-0.0);
+	const __m128d knee = _mm_set1_pd(dKnee);
+	const __m128d range = _mm_set1_pd(dRange);
+	const __m128d tiny = _mm_set1_pd(DBL_MIN);
+	for (; i + 2 <= nSamples; i += 2)
+	{
+		__m128d x = _mm_loadu_pd(pSamples + i);
+		__m128d sign = _mm_and_pd(signMask, x);
+		__m128d magnitude = _mm_andnot_pd(signMask, x);
+		__m128d over = _mm_max_pd(_mm_sub_pd(magnitude, knee), _mm_setzero_pd());
+		// With the knee at 1.0 both range and over are 0 below full scale, the floor on the denominator keeps that from becoming 0/0.
+		__m128d clipped = _mm_add_pd(_mm_min_pd(magnitude, knee), _mm_div_pd(_mm_mul_pd(over, range), _mm_max_pd(_mm_add_pd(range, over), tiny)));
+		_mm_storeu_pd(pSamples + i, _mm_or_pd(clipped, sign));
+	}
+#endif
+	for (; i < nSamples; ++i)
+	{
+		double dOver = fabs(pSamples[i]) - dKnee;
+		if (dOver > 0.0)
+			pSamples[i] = copysign(dKnee + dOver * dRange / (dRange + dOver), pSamples[i]);
+	}
+}
+
+// Writes pSamples * 32767 plus pDither LSB, rounded to nearest even and saturated to Sint16.
+inline void ConvertToSint16(const double* pSamples, const double* pDither, Sint16* pOut, const int& nSamples)
+{
+	int i = 0;
+#if defined(__SSE2__)
+	const __m128d scale = _mm_set1_pd(32767.0);
+	const __m128d lowest = _mm_set1_pd(-32768.0);
+	const __m128d highest = _mm_set1_pd(32767.0);
+	for (; i + 4 <= nSamples; i += 4)
+	{
+		// Saturate before converting, out of range values would otherwise all become INT_MIN.
+		__m128d x0 = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(pSamples + i), scale), _mm_loadu_pd(pDither + i));
+		__m128d x1 = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(pSamples + i + 2), scale), _mm_loadu_pd(pDither + i + 2));
+		__m128i low = _mm_cvtpd_epi32(_mm_max_pd(_mm_min_pd(x0, highest), lowest));
+		__m128i high = _mm_cvtpd_epi32(_mm_max_pd(_mm_min_pd(x1, highest), lowest));
+		_mm_storel_epi64((__m128i*)(pOut + i), _mm_packs_epi32(_mm_unpacklo_epi64(low, high), _mm_setzero_si128()));
+	}
+#endif
+	// nearbyint rounds with the current mode like _mm_cvtpd_epi32, so both paths give the same samples.
+	for (; i < nSamples; ++i)
+		pOut[i] = (Sint16)nearbyint(SDL_max(-32768.0, SDL_min(pSamples[i] * 32767.0 + pDither[i], 32767.0)));
+}
+
+void OutputStage::Process(const double* pIn, Sint16* pOut, const int& nFrames)
+{
+	const int nSamples = nFrames * m_nChannels;
+	const int nDelay = m_nLookahead - 1;
+	double dMinGain = 1.0;
+
+	if ((int)m_dScratch.size() < nSamples)
 	{
-		if (!IsKeyWhite(i))
+		m_dScratch.resize(nSamples);
+		m_dDither.resize(nSamples);
+	}
+
+	for (int nFrame = 0; nFrame < nFrames; ++nFrame)
+	{
+		const double* pFrame = pIn + nFrame * m_nChannels;
+		double dPeak = 0.0;
+		for (int c = 0; c < m_nChannels; ++c)
+			dPeak = SDL_max(dPeak, fabs(pFrame[c]));
+
+		double dGain = LimiterGain(dPeak);
+		dMinGain = SDL_min(dMinGain, dGain);
+
+		double* pDelayed = nDelay > 0 ? &m_dDelay[(m_nFrame % nDelay) * m_nChannels] : nullptr;
+		for (int c = 0; c < m_nChannels; ++c)
 		{
-			if (x > m_PianoKeys[i].x && x < (m_PianoKeys[i].x + m_PianoKeys[i].w) && y > m_PianoKeys[i].y && y < (m_PianoKeys[i].y + m_PianoKeys[i].h))
-				return i;
+			double dSample = pFrame[c];
+			if (pDelayed != nullptr)
+				std::swap(dSample, pDelayed[c]);
+			m_dScratch[nFrame * m_nChannels + c] = dSample * dGain;
 		}
 	}
 
-	for (int i = 0; i < m_PianoKeys.size(); ++i)
+	SoftClip(m_dScratch.data(), nSamples, m_dSoftClipKnee);
+
+	// Triangular dither of +-1 LSB from the sum of two uniform xorshift values.
+	for (int i = 0; i < nSamples; ++i)
 	{
-		if (IsKeyWhite(i))
+		double dDither = 0.0;
+		for (int j = 0; j < 2; ++j)
 		{
-			if (x > m_PianoKeys[i].x && x < (m_PianoKeys[i].x + m_PianoKeys[i].w) && y > m_PianoKeys[i].y && y < (m_PianoKeys[i].y + m_PianoKeys[i].h))
-				return i;
+			m_nDitherState ^= m_nDitherState << 13;
+			m_nDitherState ^= m_nDitherState >> 17;
+			m_nDitherState ^= m_nDitherState << 5;
+			dDither += (m_nDitherState >> 8) * (1.0 / 16777216.0) - 0.5;
 		}
+		m_dDither[i] = dDither;
 	}
 
-	return -1;
+	ConvertToSint16(m_dScratch.data(), m_dDither.data(), pOut, nSamples);
+
+	double dGainReduction = dMinGain < 1.0 ? -20.0 * log10(dMinGain) : 0.0;
+	m_dBlockGainReduction = dGainReduction;
+	double dPrevious = m_dMaxGainReduction.load();
+	while (dGainReduction > dPrevious && !m_dMaxGainReduction.compare_exchange_weak(dPrevious, dGainReduction));
 }
 
-SDL_AudioDeviceID device;
+double OutputStage::TakeGainReduction()
+{
+	return m_dMaxGainReduction.exchange(0.0);
+}
+
+void OutputStage::SetFormat(const int& nSampleRate, const int& nChannels)
+{
+	SDL_LockAudioDevice(device);
+	m_nSampleRate = nSampleRate;
+	m_nChannels = SDL_max(1, nChannels);
+	Prepare();
+	SDL_UnlockAudioDevice(device);
+}
+
+void OutputStage::SetBufferSize(const int& nMaxFrames)
+{
+	SDL_LockAudioDevice(device);
+	m_nMaxFrames = SDL_max(1, nMaxFrames);
+	Prepare();
+	SDL_UnlockAudioDevice(device);
+}
+
+void OutputStage::SetLookaheadTime(const double& dNewTime)
+{
+	SDL_LockAudioDevice(device);
+	if (dNewTime < 0.0)
+		m_dLookaheadTime = 0.0;
+	else if (dNewTime > 0.02)
+		m_dLookaheadTime = 0.02;
+	else
+		m_dLookaheadTime = dNewTime;
+	Prepare();
+	SDL_UnlockAudioDevice(device);
+}
+
+void OutputStage::SetCeiling(const double& dNewCeiling)
+{
+	SDL_LockAudioDevice(device);
+	if (dNewCeiling < 0.1)
+		m_dCeiling = 0.1;
+	else if (dNewCeiling > 1.0)
+		m_dCeiling = 1.0;
+	else
+		m_dCeiling = dNewCeiling;
+	SDL_UnlockAudioDevice(device);
+}
+
+void OutputStage::SetReleaseTime(const double& dNewTime)
+{
+	SDL_LockAudioDevice(device);
+	if (dNewTime < 0.001)
+		m_dReleaseTime = 0.001;
+	else if (dNewTime > 2.0)
+		m_dReleaseTime = 2.0;
+	else
+		m_dReleaseTime = dNewTime;
+	m_dReleaseCoefficient = 1.0 - exp(-1.0 / (m_dReleaseTime * m_nSampleRate));
+	SDL_UnlockAudioDevice(device);
+}
+
+void OutputStage::SetSoftClipKnee(const double& dNewKnee)
+{
+	SDL_LockAudioDevice(device);
+	if (dNewKnee < 0.5)
+		m_dSoftClipKnee = 0.5;
+	else if (dNewKnee > 1.0)
+		m_dSoftClipKnee = 1.0;
+	else
+		m_dSoftClipKnee = dNewKnee;
+	SDL_UnlockAudioDevice(device);
+}
 
 class AudioWaveform // This class contains audio function used by the AudioSynthesizer class.
 {
@@ -223,6 +791,7 @@ public:
 		int m_nNoteID;
 		double m_dNoteOnTime;
 		double m_dNoteOffTime;
+		double m_dStealTime; // When the voice was stolen and started fading out, negative if it was not.
 		bool m_bIsNoteActive;
 
 		Note();
@@ -256,11 +825,41 @@ public:
 		void SetReleaseTime(const double& dNewTime);
 	};
 
+	struct Preset // Snapshot of every sound parameter. Loaded and validated off the audio thread, then switched to as a whole.
+	{
+		friend class AudioWaveform;
+	private:
+		Envelope ADSR;
+		Oscillator OSC1;
+		Oscillator OSC2;
+		Oscillator OSC3;
+		double m_dMasterVolume;
+		double m_dPan;
+		double m_dStereoSpread;
+		double m_dKeyPanning;
+
+		Preset* m_pNextRetired;
+
+		Preset();
+
+		void FromFields(const double* pFields);
+
+	public:
+		// Parameters as the flat list of values stored in preset files.
+		void ToFields(double* pFields) const;
+	};
+
 private:
 
 	std::vector<Note> m_Notes;
 
 	double m_dMasterVolume;
+	double m_dPan;
+	double m_dStereoSpread;
+	double m_dKeyPanning;
+
+	std::atomic<Preset*> m_pPendingPreset; // Set by ApplyPreset, taken by the audio thread at the start of its next block.
+	std::atomic<Preset*> m_pRetiredPresets; // Presets the audio thread has switched to, waiting for CollectPresets.
 
 public:
 
@@ -270,14 +869,54 @@ public:
 	Oscillator OSC3;
 	// Amplitude multiplier. Range double 0.0 - 1.0
 	void SetMasterVolume(const double& dNewAmplitude);
+	// Reads and validates a preset file written by SavePreset. Returns nullptr and logs the reason if the file is unusable. Do not call on the audio thread.
+	static Preset* LoadPreset(const char* sPath);
+	bool SavePreset(const char* sPath) const;
+	// Builds a preset from the first nNumOfFields values in preset file order, the rest keep their defaults. Returns nullptr if a value is out of range.
+	static Preset* CreatePreset(const double* pFields, const int& nNumOfFields);
+	// Parameters in preset file order from the next block on: a preset passed to ApplyPreset but not switched to yet, otherwise
+	// the current ones. Call from the thread that calls ApplyPreset, with the device locked while audio is running.
+	void GetPresetFields(double* pFields) const;
+	// Hands pPreset over to the audio thread, which switches every parameter to it at once before its next block. Takes ownership, does not lock the device.
+	void ApplyPreset(Preset* pPreset);
+	// Frees presets the audio thread is done with. Call from the thread that calls ApplyPreset.
+	void CollectPresets();
+
+	// Stereo position of the instrument. Range double -1.0 (left) - 1.0 (right)
+	void SetPan(const double& dNewPan);
+	// Spreads OSC1 to the left and OSC3 to the right of each voice. Range double 0.0 - 1.0
+	void SetStereoSpread(const double& dNewSpread);
+	// Moves voices to the right as notes go up, by this much of the stereo field per two octaves. Range double -1.0 - 1.0
+	void SetKeyPanning(const double& dNewAmount);
 
 	void NoteTriggered(const int& nKey);
 	void NoteReleased(const int& nKey);
 
-	double WaveformFunction();
+	// Number of sounding notes, including released and stolen notes that are still fading out.
+	int GetVoiceCount() const;
+	// Sounding notes that count against a voice budget. Stolen notes are on their way out and do not.
+	int GetBudgetedVoiceCount() const;
+	bool IsNoteSounding(const int& nKey) const;
+	// How willing this instrument is to give up a voice. Released notes rank above held ones, older notes above newer ones.
+	double GetStealPriority() const;
+	// Fades out the note GetStealPriority ranked over STEAL_FADE_TIME. Its slot is freed once it is silent.
+	void StealVoice();
+
+	// Computes one sample of every note into pVoices, with consecutive samples of a voice nStride apart. Each note fills nSlots voices:
+	// the sum of its oscillators, or its three oscillators separately when they are spread across the stereo field.
+	void WaveformFunction(double* pVoices, const int& nStride, const int& nSlots);
 protected:
+	// Voices each note renders into on a device with nChannels channels.
+	int GetVoiceSlots(const int& nChannels) const;
+	// Pans and adds nFrames of voices rendered by WaveformFunction to the planar channel buffers ppChannels.
+	void MixVoices(double* const* ppChannels, const int& nChannels, const double* pVoices, const int& nFrames, const int& nSlots) const;
+	// Drops notes that finished fading out. Called between blocks so voices keep their slots within a block.
+	void RemoveFinishedNotes();
+	// Switches to a preset passed to ApplyPreset, if there is one. Called by the audio thread at the start of each block.
+	void SwitchPreset();
 
 	AudioWaveform();
+	virtual ~AudioWaveform();
 
 private:
 
@@ -290,7 +929,17 @@ private:
 
 
 AudioWaveform::AudioWaveform()
-	: m_dMasterVolume(0.02)
+	: m_dMasterVolume(0.02), m_dPan(0.0), m_dStereoSpread(0.0), m_dKeyPanning(0.0), m_pPendingPreset(nullptr), m_pRetiredPresets(nullptr)
+{	}
+
+AudioWaveform::~AudioWaveform()
+{
+	delete m_pPendingPreset.exchange(nullptr);
+	CollectPresets();
+}
+
+AudioWaveform::Preset::Preset()
+	: m_dMasterVolume(0.02), m_dPan(0.0), m_dStereoSpread(0.0), m_dKeyPanning(0.0), m_pNextRetired(nullptr)
 {	}
 
 AudioWaveform::Oscillator::Oscillator()
@@ -298,44 +947,88 @@ AudioWaveform::Oscillator::Oscillator()
 {	}
 
 AudioWaveform::Note::Note()
-	: m_nNoteID(0), m_dNoteOnTime(0.0), m_dNoteOffTime(0.0), m_bIsNoteActive(false)
+	: m_nNoteID(0), m_dNoteOnTime(0.0), m_dNoteOffTime(0.0), m_dStealTime(-1.0), m_bIsNoteActive(false)
 {	}
 
 AudioWaveform::Envelope::Envelope()
 	: m_dAttackTime(0.1), m_dDecayTime(0.0), m_dReleaseTime(0.5), m_dSustainAmp(1.0), m_dStartAmp(1.0)
 {	}
 
-double AudioWaveform::WaveformFunction()
+void AudioWaveform::WaveformFunction(double* pVoices, const int& nStride, const int& nSlots)
 {	
-	double dMasterOut = 0.0;
 	for (auto &note : m_Notes)
 	{
+		if (!note.m_bIsNoteActive)
+		{
+			for (int i = 0; i < nSlots; ++i)
+				pVoices[i * nStride] = 0.0;
+			pVoices += nSlots * nStride;
+			continue;
+		}
+
 		bool bNoteFinished = false;
-		double dVoice = 0.0;
+		bool bStealFinished = false;
 
 		double dAmplitude = ADSR.ADSREnvelope(*this, note.m_dNoteOnTime, note.m_dNoteOffTime);
 		if (dAmplitude <= 0.0) bNoteFinished = true;
 
-		double dSound = m_dMasterVolume *
-			(OSC1.AudioFunction(note.m_dNoteOnTime - GetSampleTime(), AudioWaveform::Scale(note.m_nNoteID + OSC1.m_nTune) + OSC1.m_dFineTune)
-				+ OSC2.AudioFunction(note.m_dNoteOnTime - GetSampleTime(), AudioWaveform::Scale(note.m_nNoteID + OSC2.m_nTune) + OSC2.m_dFineTune)
-				+ OSC3.AudioFunction(note.m_dNoteOnTime - GetSampleTime(), AudioWaveform::Scale(note.m_nNoteID + OSC3.m_nTune) + OSC3.m_dFineTune));
+		if (note.m_dStealTime >= 0.0)
+		{
+			double dFade = 1.0 - (GetSampleTime() - note.m_dStealTime) / STEAL_FADE_TIME;
+			bStealFinished = dFade <= 0.0;
+			dAmplitude *= SDL_max(dFade, 0.0);
+		}
 
-		dVoice = dAmplitude * dSound;
+		double dOsc1 = OSC1.AudioFunction(note.m_dNoteOnTime - GetSampleTime(), AudioWaveform::Scale(note.m_nNoteID + OSC1.m_nTune) + OSC1.m_dFineTune);
+		double dOsc2 = OSC2.AudioFunction(note.m_dNoteOnTime - GetSampleTime(), AudioWaveform::Scale(note.m_nNoteID + OSC2.m_nTune) + OSC2.m_dFineTune);
+		double dOsc3 = OSC3.AudioFunction(note.m_dNoteOnTime - GetSampleTime(), AudioWaveform::Scale(note.m_nNoteID + OSC3.m_nTune) + OSC3.m_dFineTune);
 
-		dMasterOut += dVoice;
+		if (nSlots == 1)
+			pVoices[0] = dAmplitude * (m_dMasterVolume * (dOsc1 + dOsc2 + dOsc3));
+		else
+		{
+			pVoices[0] = dAmplitude * (m_dMasterVolume * dOsc1);
+			pVoices[nStride] = dAmplitude * (m_dMasterVolume * dOsc2);
+			pVoices[nStride * 2] = dAmplitude * (m_dMasterVolume * dOsc3);
+		}
+		pVoices += nSlots * nStride;
 
-		if (bNoteFinished && note.m_dNoteOffTime > note.m_dNoteOnTime)
+		if ((bNoteFinished && note.m_dNoteOffTime > note.m_dNoteOnTime) || bStealFinished)
 			note.m_bIsNoteActive = false;
 	}
+}
 
-	for (unsigned int i = 0; i < m_Notes.size(); ++i)
-	{
-		if (!m_Notes[i].m_bIsNoteActive)
-			m_Notes.erase(m_Notes.begin() + i);
-	}
+int AudioWaveform::GetVoiceSlots(const int& nChannels) const
+{
+	return nChannels > 1 && m_dStereoSpread > 0.0 ? 3 : 1;
+}
+
+void AudioWaveform::MixVoices(double* const* ppChannels, const int& nChannels, const double* pVoices, const int& nFrames, const int& nSlots) const
+{
+	double dGains[MAX_NUM_OF_CHANNELS];
+
+	for (auto &note : m_Notes)
+	{
+		double dPan = m_dPan + m_dKeyPanning * note.m_nNoteID / 24.0;
+
+		for (int i = 0; i < nSlots; ++i)
+		{
+			PanGains(nSlots == 1 ? dPan : dPan + (i - 1) * m_dStereoSpread, nChannels, dGains);
+			for (int c = 0; c < nChannels; ++c)
+				if (dGains[c] != 0.0)
+					MixInto(ppChannels[c], pVoices, nFrames, dGains[c]);
+			pVoices += nFrames;
+		}
+	}
+}
 
-	return dMasterOut;
+void AudioWaveform::RemoveFinishedNotes()
+{
+	for (unsigned int i = 0; i < m_Notes.size(); ++i)
+	{
+		if (!m_Notes[i].m_bIsNoteActive)
+			m_Notes.erase(m_Notes.begin() + i--);
+	}
 }
 
 double AudioWaveform::Oscillator::AudioFunction(const double dTime, const double dHertz)
@@ -364,7 +1057,7 @@ double AudioWaveform::Oscillator::AudioFunction(const double dTime, const double
 		return (m_dWaveAmplitude + dTremolo) * ((dOut * (2.0 / M_PI)));
 	}
 	case NOISE:
-		return (m_dWaveAmplitude + dTremolo) * ((2.0 * ((double)rand() / (double)RAND_MAX) - 1.0));
+		return (m_dWaveAmplitude + dTremolo) * NoiseSample();
 	default: // Sine wave.
 		return (m_dWaveAmplitude + dTremolo) * (sin(dFrequency));
 	}
@@ -416,9 +1109,10 @@ void AudioWaveform::NoteTriggered(const int& nKey)
 	SDL_LockAudioDevice(device);
 	bool bIsKeyActive = false;
 
+	// A stolen note keeps fading out, the key starts a new one.
 	for (unsigned int i = 0; i < m_Notes.size(); i++)
 	{
-		if (m_Notes[i].m_nNoteID == nKey)
+		if (m_Notes[i].m_nNoteID == nKey && m_Notes[i].m_dStealTime < 0.0)
 			bIsKeyActive = true;
 	}
 
@@ -426,7 +1120,7 @@ void AudioWaveform::NoteTriggered(const int& nKey)
 	{
 		for (unsigned int i = 0; i < m_Notes.size(); i++)
 		{
-			if (m_Notes[i].m_nNoteID == nKey)
+			if (m_Notes[i].m_nNoteID == nKey && m_Notes[i].m_dStealTime < 0.0)
 				m_Notes[i].m_dNoteOnTime = GetSampleTime();
 		}
 	}
@@ -452,6 +1146,323 @@ void AudioWaveform::NoteReleased(const int& nKey)
 	SDL_UnlockAudioDevice(device);
 }
 
+// Preset files ------------------------------------------------------------
+// Little endian: "SDLP", Uint16 version, Uint16 field count, Uint32 FNV-1a checksum of the fields, then every field as a double.
+// Fields are only ever appended, so older files load with the missing fields at their defaults.
+
+#define PRESET_VERSION 1
+#define PRESET_HEADER_SIZE 12
+#define PRESET_NUM_OF_FIELDS 36
+
+// Valid range of each field, in file order. Wave type, saw parts and tune must also be whole numbers.
+const double PRESET_FIELD_RANGES[PRESET_NUM_OF_FIELDS][2] = {
+	{ 0.0, 5.0 }, { 0.0, 5.0 }, { 0.0, 1.0 }, { 0.0, 1.0 }, { 0.0, 5.0 }, // ADSR: attack, decay, start, sustain, release
+	{ 0.0, 1.0 }, { 0.0, 5.0 }, { 2.0, 100.0 }, { 0.0, 100.0 }, { 0.0, 1.0 }, { 0.0, 100.0 }, { 0.0, 1.0 }, { -36.0, 36.0 }, { -1.0, 1.0 }, // OSC1
+	{ 0.0, 1.0 }, { 0.0, 5.0 }, { 2.0, 100.0 }, { 0.0, 100.0 }, { 0.0, 1.0 }, { 0.0, 100.0 }, { 0.0, 1.0 }, { -36.0, 36.0 }, { -1.0, 1.0 }, // OSC2
+	{ 0.0, 1.0 }, { 0.0, 5.0 }, { 2.0, 100.0 }, { 0.0, 100.0 }, { 0.0, 1.0 }, { 0.0, 100.0 }, { 0.0, 1.0 }, { -36.0, 36.0 }, { -1.0, 1.0 }, // OSC3
+	{ 0.0, 1.0 }, { -1.0, 1.0 }, { 0.0, 1.0 }, { -1.0, 1.0 } // Master volume, pan, stereo spread, key panning
+};
+
+bool IsPresetFieldWhole(const int& nField)
+{
+	int nOscField = (nField - 5) % 9;
+	return nField >= 5 && nField < 32 && (nOscField == 1 || nOscField == 2 || nOscField == 7);
+}
+
+Uint32 PresetChecksum(const Uint8* pData, const size_t& nSize)
+{
+	Uint32 nHash = 2166136261u;
+	for (size_t i = 0; i < nSize; ++i)
+		nHash = (nHash ^ pData[i]) * 16777619u;
+	return nHash;
+}
+
+void AudioWaveform::Preset::ToFields(double* pFields) const
+{
+	*pFields++ = ADSR.m_dAttackTime;
+	*pFields++ = ADSR.m_dDecayTime;
+	*pFields++ = ADSR.m_dStartAmp;
+	*pFields++ = ADSR.m_dSustainAmp;
+	*pFields++ = ADSR.m_dReleaseTime;
+
+	for (const Oscillator* pOsc : { &OSC1, &OSC2, &OSC3 })
+	{
+		*pFields++ = pOsc->m_dWaveAmplitude;
+		*pFields++ = pOsc->m_nWaveType;
+		*pFields++ = pOsc->m_nSawParts;
+		*pFields++ = pOsc->m_dVibratoFreq;
+		*pFields++ = pOsc->m_dVibratoAmplitude;
+		*pFields++ = pOsc->m_dTremoloFreq;
+		*pFields++ = pOsc->m_dTremoloAmplitude;
+		*pFields++ = pOsc->m_nTune;
+		*pFields++ = pOsc->m_dFineTune;
+	}
+
+	*pFields++ = m_dMasterVolume;
+	*pFields++ = m_dPan;
+	*pFields++ = m_dStereoSpread;
+	*pFields++ = m_dKeyPanning;
+}
+
+void AudioWaveform::Preset::FromFields(const double* pFields)
+{
+	ADSR.m_dAttackTime = *pFields++;
+	ADSR.m_dDecayTime = *pFields++;
+	ADSR.m_dStartAmp = *pFields++;
+	ADSR.m_dSustainAmp = *pFields++;
+	ADSR.m_dReleaseTime = *pFields++;
+
+	for (Oscillator* pOsc : { &OSC1, &OSC2, &OSC3 })
+	{
+		pOsc->m_dWaveAmplitude = *pFields++;
+		pOsc->m_nWaveType = (unsigned)*pFields++;
+		pOsc->m_nSawParts = (unsigned)*pFields++;
+		pOsc->m_dVibratoFreq = *pFields++;
+		pOsc->m_dVibratoAmplitude = *pFields++;
+		pOsc->m_dTremoloFreq = *pFields++;
+		pOsc->m_dTremoloAmplitude = *pFields++;
+		pOsc->m_nTune = (int)*pFields++;
+		pOsc->m_dFineTune = *pFields++;
+	}
+
+	m_dMasterVolume = *pFields++;
+	m_dPan = *pFields++;
+	m_dStereoSpread = *pFields++;
+	m_dKeyPanning = *pFields++;
+}
+
+AudioWaveform::Preset* AudioWaveform::LoadPreset(const char* sPath)
+{
+	size_t nSize = 0;
+	Uint8* pData = (Uint8*)SDL_LoadFile(sPath, &nSize);
+	if (pData == nullptr)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not read preset %s: %s\n", sPath, SDL_GetError());
+		return nullptr;
+	}
+
+	Uint16 nVersion = 0, nNumOfFields = 0;
+	Uint32 nChecksum = 0;
+	const char* sError = nullptr;
+
+	if (nSize < PRESET_HEADER_SIZE || SDL_memcmp(pData, "SDLP", 4) != 0)
+		sError = "not a preset file";
+	else
+	{
+		SDL_memcpy(&nVersion, pData + 4, sizeof(nVersion));
+		SDL_memcpy(&nNumOfFields, pData + 6, sizeof(nNumOfFields));
+		SDL_memcpy(&nChecksum, pData + 8, sizeof(nChecksum));
+		nVersion = SDL_SwapLE16(nVersion);
+		nNumOfFields = SDL_SwapLE16(nNumOfFields);
+		nChecksum = SDL_SwapLE32(nChecksum);
+
+		if (nVersion > PRESET_VERSION)
+			sError = "written by a newer version";
+		else if (nSize != PRESET_HEADER_SIZE + nNumOfFields * sizeof(double))
+			sError = "truncated";
+		else if (PresetChecksum(pData + PRESET_HEADER_SIZE, nSize - PRESET_HEADER_SIZE) != nChecksum)
+			sError = "checksum mismatch";
+	}
+
+	Preset* pPreset = nullptr;
+	if (sError == nullptr)
+	{
+		double dFields[PRESET_NUM_OF_FIELDS];
+		const int nNumOfKnownFields = SDL_min((int)nNumOfFields, PRESET_NUM_OF_FIELDS);
+		for (int i = 0; i < nNumOfKnownFields; ++i)
+		{
+			Uint64 nBits;
+			SDL_memcpy(&nBits, pData + PRESET_HEADER_SIZE + i * sizeof(double), sizeof(nBits));
+			nBits = SDL_SwapLE64(nBits);
+			SDL_memcpy(&dFields[i], &nBits, sizeof(double));
+		}
+
+		pPreset = CreatePreset(dFields, nNumOfKnownFields);
+		if (pPreset == nullptr)
+			sError = "value out of range";
+	}
+
+	if (sError != nullptr)
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not load preset %s: %s\n", sPath, sError);
+
+	SDL_free(pData);
+	return pPreset;
+}
+
+AudioWaveform::Preset* AudioWaveform::CreatePreset(const double* pFields, const int& nNumOfFields)
+{
+	Preset* pPreset = new Preset();
+	double dFields[PRESET_NUM_OF_FIELDS];
+	pPreset->ToFields(dFields);
+
+	for (int i = 0; i < SDL_min(nNumOfFields, PRESET_NUM_OF_FIELDS); ++i)
+	{
+		// Written this way round so that NaN fails as well.
+		if (!(pFields[i] >= PRESET_FIELD_RANGES[i][0] && pFields[i] <= PRESET_FIELD_RANGES[i][1]) || (IsPresetFieldWhole(i) && pFields[i] != floor(pFields[i])))
+		{
+			delete pPreset;
+			return nullptr;
+		}
+		dFields[i] = pFields[i];
+	}
+
+	pPreset->FromFields(dFields);
+	return pPreset;
+}
+
+void AudioWaveform::GetPresetFields(double* pFields) const
+{
+	// Only this thread frees presets and the audio thread cannot take it while the device is locked, so it stays valid.
+	const Preset* pPending = m_pPendingPreset.load();
+	if (pPending != nullptr)
+	{
+		pPending->ToFields(pFields);
+		return;
+	}
+
+	Preset preset;
+	preset.ADSR = ADSR;
+	preset.OSC1 = OSC1;
+	preset.OSC2 = OSC2;
+	preset.OSC3 = OSC3;
+	preset.m_dMasterVolume = m_dMasterVolume;
+	preset.m_dPan = m_dPan;
+	preset.m_dStereoSpread = m_dStereoSpread;
+	preset.m_dKeyPanning = m_dKeyPanning;
+	preset.ToFields(pFields);
+}
+
+bool AudioWaveform::SavePreset(const char* sPath) const
+{
+	double dFields[PRESET_NUM_OF_FIELDS];
+	GetPresetFields(dFields);
+
+	Uint8 data[PRESET_NUM_OF_FIELDS * sizeof(double)];
+	for (int i = 0; i < PRESET_NUM_OF_FIELDS; ++i)
+	{
+		Uint64 nBits;
+		SDL_memcpy(&nBits, &dFields[i], sizeof(nBits));
+		nBits = SDL_SwapLE64(nBits);
+		SDL_memcpy(data + i * sizeof(double), &nBits, sizeof(nBits));
+	}
+
+	SDL_RWops* file = SDL_RWFromFile(sPath, "wb");
+	if (file == nullptr)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not write preset %s: %s\n", sPath, SDL_GetError());
+		return false;
+	}
+
+	bool bIsWritten = SDL_RWwrite(file, "SDLP", 1, 4) == 4
+		&& SDL_WriteLE16(file, PRESET_VERSION) == 1
+		&& SDL_WriteLE16(file, PRESET_NUM_OF_FIELDS) == 1
+		&& SDL_WriteLE32(file, PresetChecksum(data, sizeof(data))) == 1
+		&& SDL_RWwrite(file, data, 1, sizeof(data)) == sizeof(data);
+
+	return SDL_RWclose(file) == 0 && bIsWritten;
+}
+
+void AudioWaveform::ApplyPreset(Preset* pPreset)
+{
+	CollectPresets();
+	// The audio thread only ever takes the pending preset with an exchange, so one it never took can be freed right away.
+	delete m_pPendingPreset.exchange(pPreset);
+}
+
+void AudioWaveform::CollectPresets()
+{
+	Preset* pPreset = m_pRetiredPresets.exchange(nullptr);
+	while (pPreset != nullptr)
+	{
+		Preset* pNext = pPreset->m_pNextRetired;
+		delete pPreset;
+		pPreset = pNext;
+	}
+}
+
+void AudioWaveform::SwitchPreset()
+{
+	if (m_pPendingPreset.load(std::memory_order_relaxed) == nullptr)
+		return;
+
+	Preset* pPreset = m_pPendingPreset.exchange(nullptr);
+	if (pPreset == nullptr)
+		return;
+
+	ADSR = pPreset->ADSR;
+	OSC1 = pPreset->OSC1;
+	OSC2 = pPreset->OSC2;
+	OSC3 = pPreset->OSC3;
+	m_dMasterVolume = pPreset->m_dMasterVolume;
+	m_dPan = pPreset->m_dPan;
+	m_dStereoSpread = pPreset->m_dStereoSpread;
+	m_dKeyPanning = pPreset->m_dKeyPanning;
+
+	// Freeing is left to the main thread, the audio thread never calls the allocator.
+	pPreset->m_pNextRetired = m_pRetiredPresets.load();
+	while (!m_pRetiredPresets.compare_exchange_weak(pPreset->m_pNextRetired, pPreset));
+}
+
+int AudioWaveform::GetVoiceCount() const
+{
+	return (int)m_Notes.size();
+}
+
+int AudioWaveform::GetBudgetedVoiceCount() const
+{
+	int nCount = 0;
+	for (auto& note : m_Notes)
+		if (note.m_dStealTime < 0.0)
+			++nCount;
+	return nCount;
+}
+
+bool AudioWaveform::IsNoteSounding(const int& nKey) const
+{
+	for (auto& note : m_Notes)
+		if (note.m_nNoteID == nKey && note.m_dStealTime < 0.0)
+			return true;
+	return false;
+}
+
+// Priority of a note for stealing. Notes already released get a large bonus so they go before held notes.
+double StealPriority(const double& dSampleTime, const double& dNoteOnTime, const double& dNoteOffTime)
+{
+	if (dNoteOffTime > dNoteOnTime)
+		return 1.0e6 + dSampleTime - dNoteOffTime;
+	return dSampleTime - dNoteOnTime;
+}
+
+double AudioWaveform::GetStealPriority() const
+{
+	double dPriority = -1.0;
+	for (auto& note : m_Notes)
+		if (note.m_dStealTime < 0.0)
+			dPriority = SDL_max(dPriority, StealPriority(GetSampleTime(), note.m_dNoteOnTime, note.m_dNoteOffTime));
+	return dPriority;
+}
+
+void AudioWaveform::StealVoice()
+{
+	SDL_LockAudioDevice(device);
+	int nVictim = -1;
+	double dPriority = -1.0;
+	for (unsigned int i = 0; i < m_Notes.size(); ++i)
+	{
+		if (m_Notes[i].m_dStealTime >= 0.0)
+			continue;
+		double dNotePriority = StealPriority(GetSampleTime(), m_Notes[i].m_dNoteOnTime, m_Notes[i].m_dNoteOffTime);
+		if (dNotePriority > dPriority)
+		{
+			dPriority = dNotePriority;
+			nVictim = i;
+		}
+	}
+	if (nVictim != -1)
+		m_Notes[nVictim].m_dStealTime = GetSampleTime();
+	SDL_UnlockAudioDevice(device);
+}
+
 double AudioWaveform::Scale(const int& nNoteID)
 {
 	return 261.63 * pow(1.0594630943592952645618252949463, nNoteID);
@@ -469,6 +1480,42 @@ void AudioWaveform::SetMasterVolume(const double& dNewAmplitude)
 	SDL_UnlockAudioDevice(device);
 }
 
+void AudioWaveform::SetPan(const double& dNewPan)
+{
+	SDL_LockAudioDevice(device);
+	if (dNewPan > 1.0)
+		m_dPan = 1.0;
+	else if (dNewPan < -1.0)
+		m_dPan = -1.0;
+	else
+		m_dPan = dNewPan;
+	SDL_UnlockAudioDevice(device);
+}
+
+void AudioWaveform::SetStereoSpread(const double& dNewSpread)
+{
+	SDL_LockAudioDevice(device);
+	if (dNewSpread > 1.0)
+		m_dStereoSpread = 1.0;
+	else if (dNewSpread < 0.0)
+		m_dStereoSpread = 0.0;
+	else
+		m_dStereoSpread = dNewSpread;
+	SDL_UnlockAudioDevice(device);
+}
+
+void AudioWaveform::SetKeyPanning(const double& dNewAmount)
+{
+	SDL_LockAudioDevice(device);
+	if (dNewAmount > 1.0)
+		m_dKeyPanning = 1.0;
+	else if (dNewAmount < -1.0)
+		m_dKeyPanning = -1.0;
+	else
+		m_dKeyPanning = dNewAmount;
+	SDL_UnlockAudioDevice(device);
+}
+
 void AudioWaveform::Oscillator::SetWaveFrequency(const double& dNewFrequency)
 {
 	SDL_LockAudioDevice(device);
@@ -657,6 +1704,7 @@ struct AudioData : public AudioWaveform
 {
 	AudioData()
 	{
+		SetChannels(1);
 		SetMasterVolume(0.1);	
 
 		ADSR.SetAttackTime(0.05);
@@ -698,161 +1746,1663 @@ struct AudioData : public AudioWaveform
 
 	double m_dSampleTime = 0.0;
 	inline const double& GetSampleTime() const override { return m_dSampleTime; }
+
+	// Device sample rate in Hz.
+	void SetSampleRate(const int& nNewRate);
+	// Device channels. Range int 1 - MAX_NUM_OF_CHANNELS
+	void SetChannels(const int& nNewChannels);
+	// Select render quality: QUALITY_LIVE, QUALITY_HIGH or QUALITY_OFFLINE. Higher presets oversample the voices to reduce aliasing.
+	void SetQualityPreset(const unsigned int& nNewPreset);
+	// Largest block Render is called with and most voices sounding at once. The render buffers are allocated for these here,
+	// so the audio thread does not allocate. Larger blocks or more voices still render, but allocate on the audio thread.
+	void SetBufferSize(const int& nMaxFrames, const int& nMaxVoices);
+	// Renders nFrames samples at the device rate into one planar buffer per channel. The buffers are valid until the next call.
+	const double* const* Render(const int& nFrames);
+	// Advances the clock by nFrames without rendering. Only valid while no notes are sounding.
+	void Skip(const int& nFrames);
+
+private:
+	int m_nSampleRate = 44100;
+	int m_nChannels = 0;
+	int m_nOversampling = 1;
+	int m_nMaxFrames = DEFAULT_BLOCK_SIZE;
+	int m_nMaxVoices = 32;
+
+	// Sizes the render buffers for m_nMaxFrames and m_nMaxVoices. Called with the device locked.
+	void AllocateBuffers();
+
+	std::vector<double> m_dVoices; // Voice slots of the current block at the oversampled rate, voice by voice.
+	std::vector<std::vector<double>> m_dOversampled; // Per channel.
+	std::vector<std::vector<double>> m_dOutput; // Per channel.
+	std::vector<double*> m_pOversampled;
+	std::vector<double*> m_pOutput;
+
+	// 4x renders pass the short filter first. Its images fall far above the band kept by the long filter, which sets the final passband.
+	std::vector<HalfbandDecimator> m_FirstDecimators;
+	std::vector<HalfbandDecimator> m_FinalDecimators;
 };
 
-void MyAudioCallback(void* userdata, Uint8* stream, int streamLength) // streamLength = samples * channels * bitdepth/8
+// Soft sine and triangle pad, used for layered and split setups.
+void SetPadPatch(AudioData& audio)
+{
+	audio.SetMasterVolume(0.08);
+
+	audio.ADSR.SetAttackTime(0.4);
+	audio.ADSR.SetDecayTime(0.5);
+	audio.ADSR.SetReleaseTime(1.2);
+	audio.ADSR.SetStartAmplitude(1.0);
+	audio.ADSR.SetSusatainAmplitude(0.8);
+
+	audio.OSC1.SetWaveType(SINE_WAVE);
+	audio.OSC2.SetWaveType(TRIANGLE_WAVE);
+	audio.OSC3.SetWaveType(SINE_WAVE);
+
+	audio.OSC1.SetTune(0);
+	audio.OSC2.SetTune(12);
+	audio.OSC3.SetTune(-12);
+
+	audio.SetStereoSpread(0.5);
+	audio.SetKeyPanning(0.3);
+}
+
+void AudioData::SetSampleRate(const int& nNewRate)
+{
+	SDL_LockAudioDevice(device);
+	if (nNewRate < 8000)
+		m_nSampleRate = 8000;
+	else if (nNewRate > 192000)
+		m_nSampleRate = 192000;
+	else
+		m_nSampleRate = nNewRate;
+	SDL_UnlockAudioDevice(device);
+}
+
+void AudioData::SetChannels(const int& nNewChannels)
 {
-	AudioData* audio = static_cast<AudioData*>(userdata);
+	SDL_LockAudioDevice(device);
+	m_nChannels = SDL_max(1, SDL_min(nNewChannels, MAX_NUM_OF_CHANNELS));
+	m_dOversampled.resize(m_nChannels);
+	m_dOutput.resize(m_nChannels);
+	m_pOversampled.resize(m_nChannels);
+	m_pOutput.resize(m_nChannels);
+	m_FirstDecimators.assign(m_nChannels, HalfbandDecimator(23, 9.0));
+	m_FinalDecimators.assign(m_nChannels, HalfbandDecimator(111, 9.0));
+	AllocateBuffers();
+	SDL_UnlockAudioDevice(device);
+}
 
-	for (Uint32 i = 0; i < streamLength / 2; ++i)
+void AudioData::SetQualityPreset(const unsigned int& nNewPreset)
+{
+	SDL_LockAudioDevice(device);
+	switch (nNewPreset)
+	{
+	case QUALITY_HIGH: m_nOversampling = 2; break;
+	case QUALITY_OFFLINE: m_nOversampling = 4; break;
+	default: m_nOversampling = 1;
+	}
+	for (int c = 0; c < m_nChannels; ++c)
 	{
-		((Sint16*)stream)[i] = 0;
+		m_FirstDecimators[c].Reset();
+		m_FinalDecimators[c].Reset();
+	}
+	AllocateBuffers();
+	SDL_UnlockAudioDevice(device);
+}
 
-		((Sint16*)stream)[i] += Sint16(audio->WaveformFunction() * 32767);
-			
-		audio->m_dSampleTime += 1.0 / 41000.0;
-	}		
+void AudioData::SetBufferSize(const int& nMaxFrames, const int& nMaxVoices)
+{
+	SDL_LockAudioDevice(device);
+	m_nMaxFrames = SDL_max(1, nMaxFrames);
+	m_nMaxVoices = SDL_max(1, nMaxVoices);
+	AllocateBuffers();
+	SDL_UnlockAudioDevice(device);
 }
 
-int main(int argc, char* args[])
+void AudioData::AllocateBuffers()
 {
-	SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Running...\n");
+	// Stereo spread can be switched on at any time, so multichannel output always has room for three slots per voice.
+	// Stolen voices fade out next to the ones that replaced them, so there is room for twice the budget.
+	const int nMaxSlots = m_nChannels > 1 ? 3 : 1;
+	const int nMaxOversampledFrames = m_nMaxFrames * m_nOversampling;
 
-	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
-		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
-	else
+	if ((int)m_dVoices.size() < 2 * m_nMaxVoices * nMaxSlots * nMaxOversampledFrames)
+		m_dVoices.resize(2 * m_nMaxVoices * nMaxSlots * nMaxOversampledFrames);
+
+	for (int c = 0; c < m_nChannels; ++c)
 	{
-		if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1"))
-		{
-			SDL_Log("Warning: Linear texture filtering not enabled!");
-		}
-#ifdef __ANDROID__
-		SDL_DisplayMode displayMode;
-		if (SDL_GetCurrentDisplayMode(0, &displayMode) == 0)		
-			window = SDL_CreateWindow("SDL Framework", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, displayMode.w, displayMode.h, SDL_WINDOW_SHOWN);
-		else
-			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Could not get display mode for video display #%d: %s", 0, SDL_GetError());
-#else
-		window = SDL_CreateWindow("SDL Framework", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1024, 576, SDL_WINDOW_SHOWN);
-#endif
-		if (window == nullptr)
-			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Window could not be created! SDL_Error: %s\n", SDL_GetError());
-		else
-		{			
-            gRenderer = SDL_CreateRenderer( window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC );
-            if( gRenderer == NULL )
-                SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Renderer could not be created! SDL Error: %s\n", SDL_GetError() );
-			else      
-				SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0x00, 0xFF);
+		if ((int)m_dOutput[c].size() < m_nMaxFrames)
+			m_dOutput[c].resize(m_nMaxFrames);
+		if ((int)m_dOversampled[c].size() < nMaxOversampledFrames)
+			m_dOversampled[c].resize(nMaxOversampledFrames);
+		m_FirstDecimators[c].Reserve(m_nMaxFrames * 2);
+		m_FinalDecimators[c].Reserve(m_nMaxFrames);
+	}
+}
 
-			SDL_AudioSpec spec;
-			//SDL_AudioDeviceID device;
-			AudioData audioData;
+const double* const* AudioData::Render(const int& nFrames)
+{
+	SwitchPreset();
 
-			SDL_memset(&spec, 0, sizeof(spec));
+	const int nOversampledFrames = nFrames * m_nOversampling;
+	const double dTimeStep = 1.0 / ((double)m_nSampleRate * m_nOversampling);
+	const int nSlots = GetVoiceSlots(m_nChannels);
 
-			spec.userdata = &audioData;
-			spec.channels = 1;
-			spec.freq = 44100;
-			spec.format = AUDIO_S16SYS;
-			spec.samples = 512;
-			spec.callback = MyAudioCallback;
+	// Only grows beyond SetBufferSize, e.g. for an instrument rendered on its own without a voice budget.
+	if ((int)m_dVoices.size() < GetVoiceCount() * nSlots * nOversampledFrames)
+		m_dVoices.resize(GetVoiceCount() * nSlots * nOversampledFrames);
 
-			device = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0);
+	for (int c = 0; c < m_nChannels; ++c)
+	{
+		if ((int)m_dOutput[c].size() < nFrames)
+			m_dOutput[c].resize(nFrames);
+		if ((int)m_dOversampled[c].size() < nOversampledFrames)
+			m_dOversampled[c].resize(nOversampledFrames);
+
+		m_pOutput[c] = m_dOutput[c].data();
+		m_pOversampled[c] = m_nOversampling > 1 ? m_dOversampled[c].data() : m_pOutput[c];
+		std::fill(m_pOversampled[c], m_pOversampled[c] + nOversampledFrames, 0.0);
+	}
 
-			if (device == 0)
-				SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Could not open audio device %s\n", SDL_GetError());
+	for (int i = 0; i < nOversampledFrames; ++i)
+	{
+		WaveformFunction(&m_dVoices[i], nOversampledFrames, nSlots);
+		m_dSampleTime += dTimeStep;
+	}
 
-			SDL_PauseAudioDevice(device, 0);
-			// ----------------------------------------------------------------------
-			for (unsigned int i = 0; i < m_PianoKeys.size(); ++i)			
-				if (IsKeyWhite(i)) 
-					m_nNumofWhiteKeys += 1;
+	MixVoices(m_pOversampled.data(), m_nChannels, m_dVoices.data(), nOversampledFrames, nSlots);
+	RemoveFinishedNotes();
 
-			CalculateLayout();
-			// ----------------------------------------------------------------------
+	for (int c = 0; c < m_nChannels; ++c)
+	{
+		if (m_nOversampling == 4)
+			m_FirstDecimators[c].Process(m_pOversampled[c], m_pOversampled[c], nFrames * 2);
+		if (m_nOversampling > 1)
+			m_FinalDecimators[c].Process(m_pOversampled[c], m_pOutput[c], nFrames);
+	}
 
-			bool quit = false;
+	return m_pOutput.data();
+}
 
-			SDL_Event e;
-#ifdef __EMSCRIPTEN__
-			std::function<void()> mainLoop = [&]() {
-#else
-			while (!quit) {
-#endif
-				SDL_SetRenderDrawColor(gRenderer, 0x88, 0x88, 0x88, 0xFF);
-				SDL_RenderClear(gRenderer);
-				while (SDL_PollEvent(&e) != 0)
-				{
-					if (e.type == SDL_QUIT)
-						quit = true;
-#ifdef __ANDROID__
-					if (e.type == SDL_FINGERDOWN)
-#else
-					if (e.type == SDL_MOUSEBUTTONDOWN)					
-						if (e.button.button == SDL_BUTTON_LEFT)
-#endif						
-						{
-							int x, y;
-#ifdef __ANDROID__
-							int width, height;
-							SDL_GetWindowSize(window, &width, &height);
-							x = e.tfinger.x * width;
-							y = e.tfinger.y * height;
-#else
-							SDL_GetMouseState(&x, &y);
-#endif
+void AudioData::Skip(const int& nFrames)
+{
+	SwitchPreset();
+	m_dSampleTime += nFrames / (double)m_nSampleRate;
+	// Whatever is left in the filters is the silent tail of the last note.
+	for (int c = 0; c < m_nChannels; ++c)
+	{
+		m_FirstDecimators[c].Reset();
+		m_FinalDecimators[c].Reset();
+	}
+}
 
-							int ht = HitTest(x, y);
-							if (ht != -1)
-							{
-								audioData.NoteTriggered(ht);
-								m_bIsKeyPressed[ht] = true;
-#ifdef __ANDROID__
-								touches.push_back(std::pair<SDL_FingerID, int>(e.tfinger.fingerId, ht));
-#endif
-							}							
-						}
-#ifdef __ANDROID__
-					if (e.type == SDL_FINGERUP)
-#else
-					if (e.type == SDL_MOUSEBUTTONUP)
-						if (e.button.button == SDL_BUTTON_LEFT)
-#endif						
-						{
-#ifdef __ANDROID__
-							for (auto it = touches.begin(); it != touches.end(); ++it)
-							{
-								if (it->first == e.tfinger.fingerId)
-								{
-									audioData.NoteReleased(it->second);
-									m_bIsKeyPressed[it->second] = false;
-									touches.erase(it);
-									break;
-								}
-							}
-#else
-							int x, y;
-							SDL_GetMouseState(&x, &y);
-							int ht = HitTest(x, y);
-							if (ht != -1)
-							{
-								audioData.NoteReleased(ht);
-								m_bIsKeyPressed[ht] = false;
-							}
-#endif
-						}
-				}
-				DrawKeys();				
-				SDL_RenderPresent(gRenderer);
+// Trace recording ---------------------------------------------------------
+// Trace files start with a 32 byte little endian header: "SDLT", Uint16 version, Uint16 record size, Uint32 setup record count,
+// Uint32 ring capacity in records, Uint64 records written to the ring, Uint64 records dropped. The setup records describing the
+// engine follow, then the ring, where record n is stored in slot n % capacity so the file keeps the most recent events.
+// Parameter records overwritten in the ring are folded into the setup records, so these always hold the patches in effect at
+// the oldest record kept. Notes held from before the oldest record are lost.
+
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 32
+#define TRACE_RECORD_SIZE 24
+#define TRACE_BUFFER_SIZE 8192 // Records buffered between the audio thread and the writer thread. Power of two.
+#define TRACE_DEFAULT_CAPACITY 262144 // Ring capacity in records, about 50 minutes of callbacks at 512 frames.
+
+#define TRACE_FORMAT 0 // nChannel = channels, nIndex = sample rate
+#define TRACE_QUALITY 1 // nIndex = quality preset
+#define TRACE_VOICE_BUDGET 2 // nIndex = voice budget
+#define TRACE_PART 3 // nChannel = channel, nIndex = lowest note, dValue = highest note
+#define TRACE_PARAMETER 4 // nChannel = part, nIndex = preset field, dValue = value
+#define TRACE_NOTE_ON 5 // nChannel = channel, nIndex = note
+#define TRACE_NOTE_OFF 6 // nChannel = channel, nIndex = note
+#define TRACE_CALLBACK 7 // nIndex = frames, dValue = seconds spent in the callback
+#define TRACE_GAIN_REDUCTION 8 // dValue = largest output limiter gain reduction in dB during the callback
+
+struct TraceRecord
+{
+	Uint16 nType;
+	Sint16 nChannel;
+	Sint32 nIndex;
+	Uint64 nFrame; // Engine sample frame the record applies from.
+	double dValue;
+};
+
+void EncodeTraceRecord(const TraceRecord& record, Uint8* pData)
+{
+	Uint16 nType = SDL_SwapLE16(record.nType);
+	Uint16 nChannel = SDL_SwapLE16((Uint16)record.nChannel);
+	Uint32 nIndex = SDL_SwapLE32((Uint32)record.nIndex);
+	Uint64 nFrame = SDL_SwapLE64(record.nFrame);
+	Uint64 nValue;
+	SDL_memcpy(&nValue, &record.dValue, sizeof(nValue));
+	nValue = SDL_SwapLE64(nValue);
+
+	SDL_memcpy(pData, &nType, 2);
+	SDL_memcpy(pData + 2, &nChannel, 2);
+	SDL_memcpy(pData + 4, &nIndex, 4);
+	SDL_memcpy(pData + 8, &nFrame, 8);
+	SDL_memcpy(pData + 16, &nValue, 8);
+}
+
+TraceRecord DecodeTraceRecord(const Uint8* pData)
+{
+	Uint16 nType, nChannel;
+	Uint32 nIndex;
+	Uint64 nFrame, nValue;
+	SDL_memcpy(&nType, pData, 2);
+	SDL_memcpy(&nChannel, pData + 2, 2);
+	SDL_memcpy(&nIndex, pData + 4, 4);
+	SDL_memcpy(&nFrame, pData + 8, 8);
+	SDL_memcpy(&nValue, pData + 16, 8);
+
+	TraceRecord record;
+	record.nType = SDL_SwapLE16(nType);
+	record.nChannel = (Sint16)SDL_SwapLE16(nChannel);
+	record.nIndex = (Sint32)SDL_SwapLE32(nIndex);
+	record.nFrame = SDL_SwapLE64(nFrame);
+	nValue = SDL_SwapLE64(nValue);
+	SDL_memcpy(&record.dValue, &nValue, sizeof(nValue));
+	return record;
+}
+
+class TraceRecorder // Writes engine events to a trace file from a background thread. Recording never blocks or allocates.
+{
+	SDL_RWops* m_File;
+	SDL_Thread* m_Thread;
+
+	std::vector<TraceRecord> m_Buffer;
+	std::atomic<Uint32> m_nBufferWrite;
+	std::atomic<Uint32> m_nBufferRead;
+	std::atomic<bool> m_bIsRunning;
+
+	Uint32 m_nNumOfSetupRecords;
+	std::vector<TraceRecord> m_Setup; // Copy of the setup records in the file, updated by the writer thread.
+	Uint32 m_nCapacity;
+	Uint64 m_nWritten;
+	std::atomic<Uint64> m_nDropped;
+
+	bool WriteHeader();
+	// Folds the parameter records about to be overwritten in nRun slots from nSlot into the setup records. Returns true if any changed.
+	bool FoldOverwritten(const Uint32& nSlot, const Uint32& nRun);
+	void Drain();
+	static int WriterThread(void* pData);
+
+public:
+	TraceRecorder();
+	~TraceRecorder();
+
+	// Creates the trace file with a ring of nCapacity records. Returns false and logs if the file could not be created.
+	bool Open(const char* sPath, const Uint32& nCapacity = TRACE_DEFAULT_CAPACITY);
+	// Writes a record describing the engine straight to the file. Only before Start.
+	void RecordSetup(const Uint16& nType, const int& nChannel, const int& nIndex, const double& dValue);
+	// Starts the writer thread. Returns false and logs if it could not be started.
+	bool Start();
+	// Queues a record for the ring. Callers must hold the audio device lock, which SDL also holds during the audio callback,
+	// so only one thread records at a time. Records are dropped and counted if the writer falls behind.
+	void Record(const Uint16& nType, const int& nChannel, const int& nIndex, const Uint64& nFrame, const double& dValue);
+	// Stops the writer thread, writes everything still queued and closes the file.
+	void Close();
+};
+
+TraceRecorder::TraceRecorder()
+	: m_File(nullptr), m_Thread(nullptr), m_Buffer(TRACE_BUFFER_SIZE), m_nBufferWrite(0), m_nBufferRead(0), m_bIsRunning(false),
+	m_nNumOfSetupRecords(0), m_nCapacity(0), m_nWritten(0), m_nDropped(0)
+{	}
+
+TraceRecorder::~TraceRecorder()
+{
+	Close();
+}
+
+bool TraceRecorder::Open(const char* sPath, const Uint32& nCapacity)
+{
+	m_nCapacity = SDL_max(nCapacity, 1u);
+	m_File = SDL_RWFromFile(sPath, "w+b");
+	if (m_File == nullptr || !WriteHeader())
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not create trace %s: %s\n", sPath, SDL_GetError());
+		Close();
+		return false;
+	}
+	return true;
+}
+
+bool TraceRecorder::WriteHeader()
+{
+	return SDL_RWseek(m_File, 0, RW_SEEK_SET) == 0
+		&& SDL_RWwrite(m_File, "SDLT", 1, 4) == 4
+		&& SDL_WriteLE16(m_File, TRACE_VERSION) == 1
+		&& SDL_WriteLE16(m_File, TRACE_RECORD_SIZE) == 1
+		&& SDL_WriteLE32(m_File, m_nNumOfSetupRecords) == 1
+		&& SDL_WriteLE32(m_File, m_nCapacity) == 1
+		&& SDL_WriteLE64(m_File, m_nWritten) == 1
+		&& SDL_WriteLE64(m_File, m_nDropped) == 1;
+}
+
+void TraceRecorder::RecordSetup(const Uint16& nType, const int& nChannel, const int& nIndex, const double& dValue)
+{
+	if (m_File == nullptr || m_Thread != nullptr)
+		return;
+
+	TraceRecord record = { nType, (Sint16)nChannel, nIndex, 0, dValue };
+	Uint8 data[TRACE_RECORD_SIZE];
+	EncodeTraceRecord(record, data);
+	SDL_RWseek(m_File, TRACE_HEADER_SIZE + m_nNumOfSetupRecords * TRACE_RECORD_SIZE, RW_SEEK_SET);
+	if (SDL_RWwrite(m_File, data, 1, sizeof(data)) == sizeof(data))
+	{
+		m_Setup.push_back(record);
+		++m_nNumOfSetupRecords;
+	}
+}
+
+bool TraceRecorder::Start()
+{
+	if (m_File == nullptr)
+		return false;
+
+	WriteHeader();
+	m_bIsRunning = true;
+	m_Thread = SDL_CreateThread(WriterThread, "TraceWriter", this);
+	if (m_Thread == nullptr)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not start trace writer: %s\n", SDL_GetError());
+		m_bIsRunning = false;
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void TraceRecorder::Record(const Uint16& nType, const int& nChannel, const int& nIndex, const Uint64& nFrame, const double& dValue)
+{
+	if (!m_bIsRunning.load(std::memory_order_relaxed))
+		return;
+
+	Uint32 nWrite = m_nBufferWrite.load(std::memory_order_relaxed);
+	if (nWrite - m_nBufferRead.load(std::memory_order_acquire) >= TRACE_BUFFER_SIZE)
+	{
+		m_nDropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	TraceRecord& record = m_Buffer[nWrite & (TRACE_BUFFER_SIZE - 1)];
+	record.nType = nType;
+	record.nChannel = (Sint16)nChannel;
+	record.nIndex = nIndex;
+	record.nFrame = nFrame;
+	record.dValue = dValue;
+	m_nBufferWrite.store(nWrite + 1, std::memory_order_release);
+}
+
+void TraceRecorder::Drain()
+{
+	const Uint32 nRead = m_nBufferRead.load(std::memory_order_relaxed);
+	const Uint32 nWrite = m_nBufferWrite.load(std::memory_order_acquire);
+	if (nRead == nWrite)
+		return;
+
+	const Sint64 nRingStart = TRACE_HEADER_SIZE + (Sint64)m_nNumOfSetupRecords * TRACE_RECORD_SIZE;
+	Uint8 data[64 * TRACE_RECORD_SIZE];
+	bool bIsSetupChanged = false;
+
+	// Write in runs that stop at the end of the ring so each run is one seek and one write.
+	for (Uint32 i = nRead; i != nWrite;)
+	{
+		const Uint32 nSlot = (Uint32)(m_nWritten % m_nCapacity);
+		const Uint32 nRun = SDL_min(SDL_min(nWrite - i, 64u), m_nCapacity - nSlot);
+		if (m_nWritten >= m_nCapacity && FoldOverwritten(nSlot, nRun))
+			bIsSetupChanged = true;
+
+		for (Uint32 j = 0; j < nRun; ++j)
+			EncodeTraceRecord(m_Buffer[(i + j) & (TRACE_BUFFER_SIZE - 1)], data + j * TRACE_RECORD_SIZE);
+
+		SDL_RWseek(m_File, nRingStart + (Sint64)nSlot * TRACE_RECORD_SIZE, RW_SEEK_SET);
+		SDL_RWwrite(m_File, data, TRACE_RECORD_SIZE, nRun);
+		m_nWritten += nRun;
+		i += nRun;
+	}
+	m_nBufferRead.store(nWrite, std::memory_order_release);
+
+	if (bIsSetupChanged)
+	{
+		std::vector<Uint8> setup(m_Setup.size() * TRACE_RECORD_SIZE);
+		for (size_t i = 0; i < m_Setup.size(); ++i)
+			EncodeTraceRecord(m_Setup[i], &setup[i * TRACE_RECORD_SIZE]);
+		SDL_RWseek(m_File, TRACE_HEADER_SIZE, RW_SEEK_SET);
+		SDL_RWwrite(m_File, setup.data(), 1, setup.size());
+	}
+
+	// Keep the header current so a trace survives the application being killed.
+	WriteHeader();
+}
+
+bool TraceRecorder::FoldOverwritten(const Uint32& nSlot, const Uint32& nRun)
+{
+	Uint8 data[64 * TRACE_RECORD_SIZE];
+	SDL_RWseek(m_File, TRACE_HEADER_SIZE + ((Sint64)m_nNumOfSetupRecords + nSlot) * TRACE_RECORD_SIZE, RW_SEEK_SET);
+	if (SDL_RWread(m_File, data, TRACE_RECORD_SIZE, nRun) != nRun)
+		return false;
+
+	bool bIsChanged = false;
+	for (Uint32 j = 0; j < nRun; ++j)
+	{
+		const TraceRecord old = DecodeTraceRecord(data + j * TRACE_RECORD_SIZE);
+		if (old.nType != TRACE_PARAMETER)
+			continue;
+		for (auto& setup : m_Setup)
+		{
+			if (setup.nType == TRACE_PARAMETER && setup.nChannel == old.nChannel && setup.nIndex == old.nIndex)
+			{
+				setup.dValue = old.dValue;
+				bIsChanged = true;
+				break;
+			}
+		}
+	}
+	return bIsChanged;
+}
+
+int TraceRecorder::WriterThread(void* pData)
+{
+	TraceRecorder* pTrace = static_cast<TraceRecorder*>(pData);
+	while (pTrace->m_bIsRunning)
+	{
+		pTrace->Drain();
+		SDL_Delay(10);
+	}
+	return 0;
+}
+
+void TraceRecorder::Close()
+{
+	m_bIsRunning = false;
+	if (m_Thread != nullptr)
+	{
+		SDL_WaitThread(m_Thread, nullptr);
+		m_Thread = nullptr;
+	}
+	if (m_File != nullptr)
+	{
+		Drain();
+		WriteHeader();
+		SDL_RWclose(m_File);
+		m_File = nullptr;
+	}
+}
+
+// Reads a trace file written by TraceRecorder. Ring records are returned oldest first. Returns false and logs if the file is unusable.
+bool ReadTrace(const char* sPath, std::vector<TraceRecord>& setup, std::vector<TraceRecord>& events, Uint64& nDropped)
+{
+	size_t nSize = 0;
+	Uint8* pData = (Uint8*)SDL_LoadFile(sPath, &nSize);
+	if (pData == nullptr)
+	{
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not read trace %s: %s\n", sPath, SDL_GetError());
+		return false;
+	}
+
+	Uint16 nVersion = 0, nRecordSize = 0;
+	Uint32 nNumOfSetupRecords = 0, nCapacity = 0;
+	Uint64 nWritten = 0;
+	const char* sError = nullptr;
+
+	if (nSize < TRACE_HEADER_SIZE || SDL_memcmp(pData, "SDLT", 4) != 0)
+		sError = "not a trace file";
+	else
+	{
+		SDL_memcpy(&nVersion, pData + 4, 2);
+		SDL_memcpy(&nRecordSize, pData + 6, 2);
+		SDL_memcpy(&nNumOfSetupRecords, pData + 8, 4);
+		SDL_memcpy(&nCapacity, pData + 12, 4);
+		SDL_memcpy(&nWritten, pData + 16, 8);
+		SDL_memcpy(&nDropped, pData + 24, 8);
+		nVersion = SDL_SwapLE16(nVersion);
+		nRecordSize = SDL_SwapLE16(nRecordSize);
+		nNumOfSetupRecords = SDL_SwapLE32(nNumOfSetupRecords);
+		nCapacity = SDL_SwapLE32(nCapacity);
+		nWritten = SDL_SwapLE64(nWritten);
+		nDropped = SDL_SwapLE64(nDropped);
+
+		if (nVersion > TRACE_VERSION || nRecordSize != TRACE_RECORD_SIZE || nCapacity == 0)
+			sError = "unsupported version";
+		else if (nSize < TRACE_HEADER_SIZE + ((Uint64)nNumOfSetupRecords + SDL_min(nWritten, (Uint64)nCapacity)) * TRACE_RECORD_SIZE)
+			sError = "truncated";
+	}
+
+	if (sError == nullptr)
+	{
+		const Uint8* pSetup = pData + TRACE_HEADER_SIZE;
+		const Uint8* pRing = pSetup + nNumOfSetupRecords * TRACE_RECORD_SIZE;
+
+		setup.clear();
+		for (Uint32 i = 0; i < nNumOfSetupRecords; ++i)
+			setup.push_back(DecodeTraceRecord(pSetup + i * TRACE_RECORD_SIZE));
+
+		// Once the ring has wrapped the oldest record is the one that would be overwritten next.
+		const Uint64 nFirst = nWritten > nCapacity ? nWritten - nCapacity : 0;
+		events.clear();
+		for (Uint64 i = nFirst; i < nWritten; ++i)
+			events.push_back(DecodeTraceRecord(pRing + (i % nCapacity) * TRACE_RECORD_SIZE));
+	}
+	else
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not read trace %s: %s\n", sPath, sError);
+
+	SDL_free(pData);
+	return sError == nullptr;
+}
+
+class AudioEngine // Hosts the instrument parts, mixes them into one device stream and shares a voice budget between them.
+{
+	struct Part
+	{
+		std::unique_ptr<AudioData> pInstrument;
+		int nChannel;
+		int nLowestNote;
+		int nHighestNote;
+	};
+
+	std::vector<Part> m_Parts;
+	std::vector<std::vector<double>> m_dMix; // Per channel.
+	std::vector<double> m_dInterleaved;
+
+	int m_nVoiceBudget;
+	int m_nSampleRate;
+	int m_nChannels;
+	int m_nMaxFrames;
+	unsigned int m_nQualityPreset;
+
+	Uint64 m_nFramesRendered;
+	TraceRecorder* m_pTrace;
+
+	void MakeRoomForVoice();
+	// Sizes the mix buffers for m_nMaxFrames. Called with the device locked.
+	void AllocateBuffers();
+
+public:
+	AudioEngine();
+
+	OutputStage Output;
+
+	// Adds an instrument playing notes nLowestNote - nHighestNote of nChannel. Parts sharing a channel layer, parts with separate note ranges split it.
+	AudioData& AddPart(const int& nChannel, const int& nLowestNote = INT_MIN, const int& nHighestNote = INT_MAX);
+	AudioData& GetPart(const int& nPart) { return *m_Parts[nPart].pInstrument; }
+	int GetNumOfParts() const { return (int)m_Parts.size(); }
+	// Switches part nPart to pPreset at the start of the next block. Takes ownership.
+	void ApplyPreset(const int& nPart, AudioWaveform::Preset* pPreset);
+
+	void NoteTriggered(const int& nChannel, const int& nKey);
+	void NoteReleased(const int& nChannel, const int& nKey);
+
+	// Voices sounding at once across all parts. The oldest released, then the oldest held, voice is stolen beyond that and faded out
+	// over STEAL_FADE_TIME. Range int 1 - 256
+	void SetVoiceBudget(const int& nNewBudget);
+	// Device sample rate in Hz and number of channels, as negotiated with the device.
+	void SetFormat(const int& nNewRate, const int& nNewChannels);
+	int GetChannels() const { return m_nChannels; }
+	// Largest block Render is called with. All buffers are allocated here and when parts or voices are added, not on the audio thread.
+	void SetBlockSize(const int& nMaxFrames);
+	// Select render quality of all parts: QUALITY_LIVE, QUALITY_HIGH or QUALITY_OFFLINE.
+	void SetQualityPreset(const unsigned int& nNewPreset);
+
+	// Renders and mixes nFrames interleaved frames. Parts without sounding notes are skipped.
+	const double* Render(const int& nFrames);
+	Uint64 GetFramesRendered() const { return m_nFramesRendered; }
+
+	// Records the engine setup to pTrace, then every note and preset change. Set up all parts and the format first.
+	void SetTrace(TraceRecorder* pTrace);
+	TraceRecorder* GetTrace() const { return m_pTrace; }
+};
+
+AudioEngine::AudioEngine()
+	: m_dMix(1), m_nVoiceBudget(32), m_nSampleRate(44100), m_nChannels(1), m_nMaxFrames(DEFAULT_BLOCK_SIZE), m_nQualityPreset(QUALITY_LIVE), m_nFramesRendered(0), m_pTrace(nullptr)
+{
+	AllocateBuffers();
+}
+
+AudioData& AudioEngine::AddPart(const int& nChannel, const int& nLowestNote, const int& nHighestNote)
+{
+	Part part;
+	part.pInstrument.reset(new AudioData());
+	part.pInstrument->SetSampleRate(m_nSampleRate);
+	part.pInstrument->SetChannels(m_nChannels);
+	part.pInstrument->SetQualityPreset(m_nQualityPreset);
+	part.pInstrument->SetBufferSize(m_nMaxFrames, m_nVoiceBudget);
+	part.nChannel = nChannel;
+	part.nLowestNote = nLowestNote;
+	part.nHighestNote = nHighestNote;
+
+	SDL_LockAudioDevice(device);
+	if (!m_Parts.empty()) // Keep the clocks of all parts in step.
+		part.pInstrument->m_dSampleTime = m_Parts.front().pInstrument->m_dSampleTime;
+	m_Parts.push_back(std::move(part));
+	SDL_UnlockAudioDevice(device);
+
+	return *m_Parts.back().pInstrument;
+}
+
+void AudioEngine::MakeRoomForVoice()
+{
+	int nVoices = 0;
+	for (auto& part : m_Parts)
+		nVoices += part.pInstrument->GetBudgetedVoiceCount();
+
+	for (; nVoices >= m_nVoiceBudget; --nVoices)
+	{
+		AudioData* pVictim = nullptr;
+		double dPriority = -1.0;
+		for (auto& part : m_Parts)
+		{
+			double dPartPriority = part.pInstrument->GetStealPriority();
+			if (dPartPriority > dPriority)
+			{
+				dPriority = dPartPriority;
+				pVictim = part.pInstrument.get();
+			}
+		}
+		if (pVictim == nullptr)
+			break;
+		pVictim->StealVoice();
+	}
+}
+
+void AudioEngine::NoteTriggered(const int& nChannel, const int& nKey)
+{
+	SDL_LockAudioDevice(device);
+	if (m_pTrace != nullptr)
+		m_pTrace->Record(TRACE_NOTE_ON, nChannel, nKey, m_nFramesRendered, 0.0);
+	for (auto& part : m_Parts)
+	{
+		if (part.nChannel == nChannel && nKey >= part.nLowestNote && nKey <= part.nHighestNote)
+		{
+			if (!part.pInstrument->IsNoteSounding(nKey))
+				MakeRoomForVoice();
+			part.pInstrument->NoteTriggered(nKey);
+		}
+	}
+	SDL_UnlockAudioDevice(device);
+}
+
+void AudioEngine::NoteReleased(const int& nChannel, const int& nKey)
+{
+	SDL_LockAudioDevice(device);
+	if (m_pTrace != nullptr)
+		m_pTrace->Record(TRACE_NOTE_OFF, nChannel, nKey, m_nFramesRendered, 0.0);
+	for (auto& part : m_Parts)
+		if (part.nChannel == nChannel && nKey >= part.nLowestNote && nKey <= part.nHighestNote)
+			part.pInstrument->NoteReleased(nKey);
+	SDL_UnlockAudioDevice(device);
+}
+
+void AudioEngine::ApplyPreset(const int& nPart, AudioWaveform::Preset* pPreset)
+{
+	if (m_pTrace == nullptr)
+	{
+		m_Parts[nPart].pInstrument->ApplyPreset(pPreset);
+		return;
+	}
+
+	// Holding the lock makes the switch happen exactly at the frame recorded.
+	double dFields[PRESET_NUM_OF_FIELDS];
+	pPreset->ToFields(dFields);
+	SDL_LockAudioDevice(device);
+	for (int i = 0; i < PRESET_NUM_OF_FIELDS; ++i)
+		m_pTrace->Record(TRACE_PARAMETER, nPart, i, m_nFramesRendered, dFields[i]);
+	m_Parts[nPart].pInstrument->ApplyPreset(pPreset);
+	SDL_UnlockAudioDevice(device);
+}
+
+void AudioEngine::SetVoiceBudget(const int& nNewBudget)
+{
+	SDL_LockAudioDevice(device);
+	if (nNewBudget < 1)
+		m_nVoiceBudget = 1;
+	else if (nNewBudget > 256)
+		m_nVoiceBudget = 256;
+	else
+		m_nVoiceBudget = nNewBudget;
+	for (auto& part : m_Parts)
+		part.pInstrument->SetBufferSize(m_nMaxFrames, m_nVoiceBudget);
+	SDL_UnlockAudioDevice(device);
+}
+
+void AudioEngine::SetFormat(const int& nNewRate, const int& nNewChannels)
+{
+	SDL_LockAudioDevice(device);
+	m_nSampleRate = nNewRate;
+	m_nChannels = SDL_max(1, SDL_min(nNewChannels, MAX_NUM_OF_CHANNELS));
+	m_dMix.resize(m_nChannels);
+	for (auto& part : m_Parts)
+	{
+		part.pInstrument->SetSampleRate(m_nSampleRate);
+		part.pInstrument->SetChannels(m_nChannels);
+	}
+	Output.SetFormat(m_nSampleRate, m_nChannels);
+	AllocateBuffers();
+	SDL_UnlockAudioDevice(device);
+}
+
+void AudioEngine::SetBlockSize(const int& nMaxFrames)
+{
+	SDL_LockAudioDevice(device);
+	m_nMaxFrames = SDL_max(1, nMaxFrames);
+	for (auto& part : m_Parts)
+		part.pInstrument->SetBufferSize(m_nMaxFrames, m_nVoiceBudget);
+	Output.SetBufferSize(m_nMaxFrames);
+	AllocateBuffers();
+	SDL_UnlockAudioDevice(device);
+}
+
+void AudioEngine::AllocateBuffers()
+{
+	for (auto& mix : m_dMix)
+		if ((int)mix.size() < m_nMaxFrames)
+			mix.resize(m_nMaxFrames);
+	if ((int)m_dInterleaved.size() < m_nMaxFrames * m_nChannels)
+		m_dInterleaved.resize(m_nMaxFrames * m_nChannels);
+}
+
+void AudioEngine::SetQualityPreset(const unsigned int& nNewPreset)
+{
+	SDL_LockAudioDevice(device);
+	for (auto& part : m_Parts)
+		part.pInstrument->SetQualityPreset(nNewPreset);
+	m_nQualityPreset = nNewPreset;
+	SDL_UnlockAudioDevice(device);
+}
+
+const double* AudioEngine::Render(const int& nFrames)
+{
+	for (auto& mix : m_dMix)
+	{
+		if ((int)mix.size() < nFrames)
+			mix.resize(nFrames);
+		std::fill(mix.begin(), mix.begin() + nFrames, 0.0);
+	}
+
+	for (auto& part : m_Parts)
+	{
+		if (part.pInstrument->GetVoiceCount() == 0)
+			part.pInstrument->Skip(nFrames);
+		else
+		{
+			const double* const* ppPart = part.pInstrument->Render(nFrames);
+			for (int c = 0; c < m_nChannels; ++c)
+				MixInto(m_dMix[c].data(), ppPart[c], nFrames, 1.0);
+		}
+	}
+
+	m_nFramesRendered += nFrames;
+
+	if (m_nChannels == 1)
+		return m_dMix[0].data();
+
+	if ((int)m_dInterleaved.size() < nFrames * m_nChannels)
+		m_dInterleaved.resize(nFrames * m_nChannels);
+	for (int c = 0; c < m_nChannels; ++c)
+		for (int i = 0; i < nFrames; ++i)
+			m_dInterleaved[i * m_nChannels + c] = m_dMix[c][i];
+
+	return m_dInterleaved.data();
+}
+
+void AudioEngine::SetTrace(TraceRecorder* pTrace)
+{
+	SDL_LockAudioDevice(device);
+	if (pTrace != nullptr)
+	{
+		pTrace->RecordSetup(TRACE_FORMAT, m_nChannels, m_nSampleRate, 0.0);
+		pTrace->RecordSetup(TRACE_QUALITY, 0, m_nQualityPreset, 0.0);
+		pTrace->RecordSetup(TRACE_VOICE_BUDGET, 0, m_nVoiceBudget, 0.0);
+		for (int nPart = 0; nPart < (int)m_Parts.size(); ++nPart)
+		{
+			const Part& part = m_Parts[nPart];
+			pTrace->RecordSetup(TRACE_PART, part.nChannel, part.nLowestNote, part.nHighestNote);
+
+			double dFields[PRESET_NUM_OF_FIELDS];
+			part.pInstrument->GetPresetFields(dFields);
+			for (int i = 0; i < PRESET_NUM_OF_FIELDS; ++i)
+				pTrace->RecordSetup(TRACE_PARAMETER, nPart, i, dFields[i]);
+		}
+	}
+	m_pTrace = pTrace;
+	SDL_UnlockAudioDevice(device);
+}
+
+void MyAudioCallback(void* userdata, Uint8* stream, int streamLength) // streamLength = samples * channels * bitdepth/8
+{
+	AudioEngine* engine = static_cast<AudioEngine*>(userdata);
+	const int nFrames = streamLength / (sizeof(Sint16) * engine->GetChannels());
+
+	TraceRecorder* pTrace = engine->GetTrace();
+	if (pTrace == nullptr)
+	{
+		engine->Output.Process(engine->Render(nFrames), (Sint16*)stream, nFrames);
+		return;
+	}
+
+	const Uint64 nFrame = engine->GetFramesRendered();
+	const Uint64 nStart = SDL_GetPerformanceCounter();
+	engine->Output.Process(engine->Render(nFrames), (Sint16*)stream, nFrames);
+	pTrace->Record(TRACE_CALLBACK, 0, nFrames, nFrame, (double)(SDL_GetPerformanceCounter() - nStart) / SDL_GetPerformanceFrequency());
+	pTrace->Record(TRACE_GAIN_REDUCTION, 0, 0, nFrame, engine->Output.GetBlockGainReduction());
+}
+
+// Golden output checks ----------------------------------------------------
+// Renders fixed note scripts headlessly and compares them with reference WAVs recorded earlier, so DSP changes can be checked
+// for audible differences and render speed regressions. The references in tests/golden are checked by ctest, re-record them
+// with --golden-record <dir> only for intended changes to the sound. The throughput baseline depends on the machine, so it is
+// not committed and lives at --baseline <file>. A check without one records it and exits with GOLDEN_SKIPPED.
+// Render times are measured relative to a fixed reference kernel timed right before each render, so a machine that is
+// busy or throttled slows both down and the check measures the engine, not the load.
+
+#define GOLDEN_SAMPLE_RATE 44100
+#define GOLDEN_BLOCK_SIZE 512
+#define GOLDEN_LENGTH 2.0
+#define GOLDEN_TIMING_RUNS 7 // Renders per case, the median kernel relative time counts.
+#define GOLDEN_KERNEL_ROUNDS 200
+#define GOLDEN_SKIPPED 77 // Exit code when the references pass but there was no throughput baseline to compare with.
+
+std::string m_sGoldenRecordDir;
+std::string m_sGoldenCheckDir;
+std::string m_sGoldenBaseline; // Defaults to baseline_<quality>.txt in the reference directory.
+double m_dGoldenMinSNR = 60.0; // dB
+double m_dGoldenMaxPeakError = 0.001;
+double m_dGoldenMaxSlowdown = 0.2; // Allowed drop in render throughput compared with the baseline, 0.2 = 20%.
+
+struct GoldenNoteEvent
+{
+	double dTime;
+	int nNote;
+	bool bPressed;
+};
+
+// Chord, fast repeated notes and high notes, where the non band limited waveforms alias the most.
+const GoldenNoteEvent GOLDEN_SCRIPT[] = {
+	{ 0.01, 0, true }, { 0.01, 4, true }, { 0.01, 7, true },
+	{ 0.40, 0, false }, { 0.40, 4, false }, { 0.40, 7, false },
+	{ 0.50, 12, true }, { 0.60, 12, false }, { 0.65, 12, true }, { 0.75, 12, false },
+	{ 0.80, 31, true }, { 0.90, 36, true }, { 1.20, 31, false }, { 1.30, 36, false },
+	{ 1.35, -24, true }, { 1.60, -24, false }
+};
+
+struct GoldenEnvelope
+{
+	const char* sName;
+	double dAttack, dDecay, dStartAmp, dSustainAmp, dRelease;
+};
+
+const GoldenEnvelope GOLDEN_ENVELOPES[] = {
+	{ "default", 0.05, 1.0, 0.7, 0.7, 0.7 },
+	{ "pluck", 0.005, 0.2, 1.0, 0.0, 0.1 },
+	{ "pad", 0.5, 0.5, 1.0, 0.6, 1.5 }
+};
+
+// Six saw notes at full volume, several times full scale, so the mix only fits through the output limiter and soft clipper.
+const GoldenNoteEvent GOLDEN_OVERLOAD_SCRIPT[] = {
+	{ 0.01, -12, true }, { 0.01, 0, true }, { 0.01, 4, true }, { 0.01, 7, true }, { 0.01, 12, true }, { 0.01, 16, true },
+	{ 1.20, -12, false }, { 1.20, 0, false }, { 1.20, 4, false }, { 1.20, 7, false }, { 1.20, 12, false }, { 1.20, 16, false }
+};
+
+struct GoldenCase
+{
+	std::string sName;
+	int nChannels;
+	std::function<double(std::vector<double>&)> Render; // Fills the interleaved output and returns the render time in seconds.
+};
+
+const char* GOLDEN_WAVE_NAMES[] = { "sine", "square", "saw", "triangle", "analogsaw", "noise" };
+const char* GOLDEN_QUALITY_NAMES[] = { "live", "high", "offline" };
+
+// Renders GOLDEN_SCRIPT with every oscillator set to nWaveType. Returns the render time in seconds.
+double RenderGolden(const unsigned int& nWaveType, const GoldenEnvelope& envelope, std::vector<double>& output)
+{
+	AudioData audio;
+	audio.SetSampleRate(GOLDEN_SAMPLE_RATE);
+	audio.SetQualityPreset(m_nQualityPreset);
+	audio.OSC1.SetWaveType(nWaveType, 20);
+	audio.OSC2.SetWaveType(nWaveType, 20);
+	audio.OSC3.SetWaveType(nWaveType, 20);
+	audio.ADSR.SetAttackTime(envelope.dAttack);
+	audio.ADSR.SetDecayTime(envelope.dDecay);
+	audio.ADSR.SetStartAmplitude(envelope.dStartAmp);
+	audio.ADSR.SetSusatainAmplitude(envelope.dSustainAmp);
+	audio.ADSR.SetReleaseTime(envelope.dRelease);
+	SeedNoise(1);
+
+	const int nFrames = (int)(GOLDEN_LENGTH * GOLDEN_SAMPLE_RATE);
+	const int nNumOfEvents = sizeof(GOLDEN_SCRIPT) / sizeof(GOLDEN_SCRIPT[0]);
+	int nNextEvent = 0;
+	output.assign(nFrames, 0.0);
+
+	Uint64 nStart = SDL_GetPerformanceCounter();
+	for (int nFrame = 0; nFrame < nFrames; nFrame += GOLDEN_BLOCK_SIZE)
+	{
+		// Events are applied between blocks, like input arriving between audio callbacks.
+		while (nNextEvent < nNumOfEvents && GOLDEN_SCRIPT[nNextEvent].dTime <= (double)nFrame / GOLDEN_SAMPLE_RATE)
+		{
+			if (GOLDEN_SCRIPT[nNextEvent].bPressed)
+				audio.NoteTriggered(GOLDEN_SCRIPT[nNextEvent].nNote);
+			else
+				audio.NoteReleased(GOLDEN_SCRIPT[nNextEvent].nNote);
+			++nNextEvent;
+		}
+
+		const int nBlockFrames = SDL_min(GOLDEN_BLOCK_SIZE, nFrames - nFrame);
+		const double* pBlock = audio.Render(nBlockFrames)[0];
+		for (int i = 0; i < nBlockFrames; ++i)
+			output[nFrame + i] = pBlock[i];
+	}
+	return (double)(SDL_GetPerformanceCounter() - nStart) / SDL_GetPerformanceFrequency();
+}
+
+// Renders GOLDEN_OVERLOAD_SCRIPT through an OutputStage, so the limiter, soft clipper, dither and Sint16 conversion are checked.
+double RenderGoldenOverload(std::vector<double>& output)
+{
+	AudioData audio;
+	audio.SetSampleRate(GOLDEN_SAMPLE_RATE);
+	audio.SetQualityPreset(m_nQualityPreset);
+	audio.SetMasterVolume(1.0);
+	audio.OSC1.SetWaveType(SAW_WAVE, 20);
+	audio.OSC2.SetWaveType(SAW_WAVE, 20);
+	audio.OSC3.SetWaveType(SAW_WAVE, 20);
+	OutputStage limiter;
+	limiter.SetFormat(GOLDEN_SAMPLE_RATE, 1);
+	limiter.SetBufferSize(GOLDEN_BLOCK_SIZE);
+	SeedNoise(1);
+
+	const int nFrames = (int)(GOLDEN_LENGTH * GOLDEN_SAMPLE_RATE);
+	const int nNumOfEvents = sizeof(GOLDEN_OVERLOAD_SCRIPT) / sizeof(GOLDEN_OVERLOAD_SCRIPT[0]);
+	int nNextEvent = 0;
+	Sint16 block[GOLDEN_BLOCK_SIZE];
+	output.assign(nFrames, 0.0);
+
+	Uint64 nStart = SDL_GetPerformanceCounter();
+	for (int nFrame = 0; nFrame < nFrames; nFrame += GOLDEN_BLOCK_SIZE)
+	{
+		while (nNextEvent < nNumOfEvents && GOLDEN_OVERLOAD_SCRIPT[nNextEvent].dTime <= (double)nFrame / GOLDEN_SAMPLE_RATE)
+		{
+			if (GOLDEN_OVERLOAD_SCRIPT[nNextEvent].bPressed)
+				audio.NoteTriggered(GOLDEN_OVERLOAD_SCRIPT[nNextEvent].nNote);
+			else
+				audio.NoteReleased(GOLDEN_OVERLOAD_SCRIPT[nNextEvent].nNote);
+			++nNextEvent;
+		}
+
+		const int nBlockFrames = SDL_min(GOLDEN_BLOCK_SIZE, nFrames - nFrame);
+		limiter.Process(audio.Render(nBlockFrames)[0], block, nBlockFrames);
+		for (int i = 0; i < nBlockFrames; ++i)
+			output[nFrame + i] = block[i] / 32767.0;
+	}
+	return (double)(SDL_GetPerformanceCounter() - nStart) / SDL_GetPerformanceFrequency();
+}
+
+// Pad alone, so spread and key panning place every note of GOLDEN_SCRIPT differently.
+void SetupGoldenPad(AudioEngine& engine)
+{
+	SetPadPatch(engine.AddPart(0));
+}
+
+// Pad below middle C and a default part panned right above it, so the mix of differently panned parts is checked too.
+void SetupGoldenSplit(AudioEngine& engine)
+{
+	SetPadPatch(engine.AddPart(0, INT_MIN, -1));
+	engine.AddPart(0, 0).SetPan(0.6);
+}
+
+// Renders GOLDEN_SCRIPT on channel 0 of a stereo AudioEngine set up by Setup. The output is the interleaved mix before the OutputStage.
+double RenderGoldenStereo(void (*Setup)(AudioEngine&), std::vector<double>& output)
+{
+	AudioEngine engine;
+	Setup(engine);
+	engine.SetFormat(GOLDEN_SAMPLE_RATE, 2);
+	engine.SetBlockSize(GOLDEN_BLOCK_SIZE);
+	engine.SetQualityPreset(m_nQualityPreset);
+	SeedNoise(1);
+
+	const int nFrames = (int)(GOLDEN_LENGTH * GOLDEN_SAMPLE_RATE);
+	const int nNumOfEvents = sizeof(GOLDEN_SCRIPT) / sizeof(GOLDEN_SCRIPT[0]);
+	int nNextEvent = 0;
+	output.assign(nFrames * 2, 0.0);
+
+	Uint64 nStart = SDL_GetPerformanceCounter();
+	for (int nFrame = 0; nFrame < nFrames; nFrame += GOLDEN_BLOCK_SIZE)
+	{
+		while (nNextEvent < nNumOfEvents && GOLDEN_SCRIPT[nNextEvent].dTime <= (double)nFrame / GOLDEN_SAMPLE_RATE)
+		{
+			if (GOLDEN_SCRIPT[nNextEvent].bPressed)
+				engine.NoteTriggered(0, GOLDEN_SCRIPT[nNextEvent].nNote);
+			else
+				engine.NoteReleased(0, GOLDEN_SCRIPT[nNextEvent].nNote);
+			++nNextEvent;
+		}
+
+		const int nBlockFrames = SDL_min(GOLDEN_BLOCK_SIZE, nFrames - nFrame);
+		const double* pBlock = engine.Render(nBlockFrames);
+		for (int i = 0; i < nBlockFrames * 2; ++i)
+			output[nFrame * 2 + i] = pBlock[i];
+	}
+	return (double)(SDL_GetPerformanceCounter() - nStart) / SDL_GetPerformanceFrequency();
+}
+
+bool WriteWav(const std::string& sPath, const std::vector<double>& samples, const int& nSampleRate, const int& nChannels)
+{
+	SDL_RWops* file = SDL_RWFromFile(sPath.c_str(), "wb");
+	if (file == nullptr)
+		return false;
+
+	const Uint32 nDataSize = (Uint32)(samples.size() * sizeof(Sint16));
+	SDL_RWwrite(file, "RIFF", 1, 4);
+	SDL_WriteLE32(file, 36 + nDataSize);
+	SDL_RWwrite(file, "WAVEfmt ", 1, 8);
+	SDL_WriteLE32(file, 16);
+	SDL_WriteLE16(file, 1); // PCM
+	SDL_WriteLE16(file, nChannels);
+	SDL_WriteLE32(file, nSampleRate);
+	SDL_WriteLE32(file, nSampleRate * nChannels * sizeof(Sint16));
+	SDL_WriteLE16(file, nChannels * sizeof(Sint16));
+	SDL_WriteLE16(file, 16);
+	SDL_RWwrite(file, "data", 1, 4);
+	SDL_WriteLE32(file, nDataSize);
+
+	for (auto dSample : samples)
+		SDL_WriteLE16(file, (Uint16)Sint16(SDL_max(-1.0, SDL_min(dSample, 1.0)) * 32767));
+
+	return SDL_RWclose(file) == 0;
+}
+
+bool ReadWav(const std::string& sPath, std::vector<double>& samples, const int& nChannels)
+{
+	SDL_AudioSpec spec;
+	Uint8* pBuffer = nullptr;
+	Uint32 nLength = 0;
+
+	if (SDL_LoadWAV(sPath.c_str(), &spec, &pBuffer, &nLength) == nullptr)
+		return false;
+
+	bool bIsValid = spec.format == AUDIO_S16LSB && spec.channels == nChannels && spec.freq == GOLDEN_SAMPLE_RATE;
+	if (bIsValid)
+	{
+		samples.resize(nLength / sizeof(Sint16));
+		for (unsigned int i = 0; i < samples.size(); ++i)
+			samples[i] = (Sint16)SDL_SwapLE16(((Uint16*)pBuffer)[i]) / 32767.0;
+	}
+
+	SDL_FreeWAV(pBuffer);
+	return bIsValid;
+}
+
+double m_dGoldenKernelSink = 0.0; // Keeps the compiler from dropping the reference kernel.
+
+// Fixed mix of sines and multiply adds, independent of the engine code. Returns the time it took in seconds.
+double TimeReferenceKernel()
+{
+	double dBuffer[4096];
+	double dSum = 0.0;
+	Uint64 nStart = SDL_GetPerformanceCounter();
+	for (int n = 0; n < GOLDEN_KERNEL_ROUNDS; ++n)
+	{
+		for (int i = 0; i < 4096; ++i)
+			dBuffer[i] = sin(i * 0.001 + n);
+		for (int i = 0; i < 4096; ++i)
+			dSum += dBuffer[i] * dBuffer[(i * 7 + n) & 4095];
+	}
+	m_dGoldenKernelSink += dSum;
+	return (double)(SDL_GetPerformanceCounter() - nStart) / SDL_GetPerformanceFrequency();
+}
+
+// Baselines hold the number of cases and their summed render cost in reference kernel runs.
+bool WriteBaseline(const std::string& sPath, const int& nNumOfCases, const double& dCost)
+{
+	SDL_RWops* file = SDL_RWFromFile(sPath.c_str(), "w");
+	std::string sBaseline = "cases " + std::to_string(nNumOfCases) + " cost " + std::to_string(dCost) + "\n";
+	bool bIsWritten = file != nullptr && SDL_RWwrite(file, sBaseline.data(), 1, sBaseline.size()) == sBaseline.size();
+	if (file != nullptr)
+		bIsWritten = SDL_RWclose(file) == 0 && bIsWritten;
+	if (!bIsWritten)
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not write %s: %s\n", sPath.c_str(), SDL_GetError());
+	return bIsWritten;
+}
+
+// Records the references when bRecord is set, otherwise compares with them. Returns the process exit code.
+int RunGoldenTests(const std::string& sDir, const bool& bRecord)
+{
+	const std::string sSuffix = std::string("_") + GOLDEN_QUALITY_NAMES[m_nQualityPreset] + ".wav";
+	const std::string sBaselinePath = !m_sGoldenBaseline.empty() ? m_sGoldenBaseline : sDir + "/baseline_" + GOLDEN_QUALITY_NAMES[m_nQualityPreset] + ".txt";
+	int nFailures = 0;
+	double dRenderTime = 0.0, dCost = 0.0;
+	std::vector<double> output, reference;
+
+	std::vector<GoldenCase> cases;
+	for (unsigned int nWave = SINE_WAVE; nWave <= NOISE; ++nWave)
+	{
+		for (const auto& envelope : GOLDEN_ENVELOPES)
+			cases.push_back({ std::string(GOLDEN_WAVE_NAMES[nWave]) + "_" + envelope.sName, 1, [nWave, &envelope](std::vector<double>& samples) { return RenderGolden(nWave, envelope, samples); } });
+	}
+	cases.push_back({ "overload_chord", 1, RenderGoldenOverload });
+	cases.push_back({ "stereo_pad", 2, [](std::vector<double>& samples) { return RenderGoldenStereo(SetupGoldenPad, samples); } });
+	cases.push_back({ "stereo_split", 2, [](std::vector<double>& samples) { return RenderGoldenStereo(SetupGoldenSplit, samples); } });
+
+	for (const auto& golden : cases)
+	{
+		const std::string& sName = golden.sName;
+		const std::string sPath = sDir + "/" + sName + sSuffix;
+
+		// The first run warms up caches and is not timed.
+		golden.Render(output);
+		double dTimes[GOLDEN_TIMING_RUNS], dCosts[GOLDEN_TIMING_RUNS];
+		for (int nRun = 0; nRun < GOLDEN_TIMING_RUNS; ++nRun)
+		{
+			double dKernelTime = TimeReferenceKernel();
+			dTimes[nRun] = golden.Render(output);
+			dCosts[nRun] = dTimes[nRun] / dKernelTime;
+		}
+		std::sort(dTimes, dTimes + GOLDEN_TIMING_RUNS);
+		std::sort(dCosts, dCosts + GOLDEN_TIMING_RUNS);
+		dRenderTime += dTimes[GOLDEN_TIMING_RUNS / 2];
+		dCost += dCosts[GOLDEN_TIMING_RUNS / 2];
+
+		if (bRecord)
+		{
+			if (!WriteWav(sPath, output, GOLDEN_SAMPLE_RATE, golden.nChannels))
+			{
+				SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "Could not write %s: %s\n", sPath.c_str(), SDL_GetError());
+				++nFailures;
+			}
+			continue;
+		}
+
+		if (!ReadWav(sPath, reference, golden.nChannels) || reference.size() != output.size())
+		{
+			SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "FAIL %s: missing or mismatched reference %s\n", sName.c_str(), sPath.c_str());
+			++nFailures;
+			continue;
+		}
+
+		double dSignal = 0.0, dNoise = 0.0, dPeakError = 0.0;
+		for (unsigned int i = 0; i < output.size(); ++i)
+		{
+			double dError = output[i] - reference[i];
+			dSignal += reference[i] * reference[i];
+			dNoise += dError * dError;
+			if (!(fabs(dError) <= dPeakError)) // Lets NaN through so that it fails the check.
+				dPeakError = fabs(dError);
+		}
+		double dSNR = 10.0 * log10(dSignal / dNoise);
+
+		bool bPassed = dSNR >= m_dGoldenMinSNR && dPeakError <= m_dGoldenMaxPeakError;
+		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%s %s: SNR %.1f dB, peak error %.6f\n", bPassed ? "PASS" : "FAIL", sName.c_str(), dSNR, dPeakError);
+		if (!bPassed)
+			++nFailures;
+	}
+
+	const int nNumOfCases = (int)cases.size();
+	const double dThroughput = nNumOfCases * GOLDEN_LENGTH * GOLDEN_SAMPLE_RATE / dRenderTime;
+
+	bool bIsSkipped = false;
+
+	if (bRecord)
+	{
+		if (!WriteBaseline(sBaselinePath, nNumOfCases, dCost))
+			++nFailures;
+		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Recorded %d references, throughput %.0f frames/s, cost %.2f\n", nNumOfCases, dThroughput, dCost);
+	}
+	else
+	{
+		size_t nSize = 0;
+		char* pBaseline = (char*)SDL_LoadFile(sBaselinePath.c_str(), &nSize);
+		int nBaselineCases = 0;
+		double dBaseline = 0.0;
+		if (pBaseline != nullptr && SDL_sscanf(pBaseline, "cases %d cost %lf", &nBaselineCases, &dBaseline) != 2)
+			dBaseline = 0.0;
+		SDL_free(pBaseline);
+
+		// A baseline recorded with a different set of cases is not comparable, so it is replaced like a missing one.
+		if (!(dBaseline > 0.0) || nBaselineCases != nNumOfCases)
+		{
+			bIsSkipped = true;
+			if (WriteBaseline(sBaselinePath, nNumOfCases, dCost))
+				SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "SKIP throughput: no baseline for %d cases at %s, recorded cost %.2f for the next run\n", nNumOfCases, sBaselinePath.c_str(), dCost);
+			else
+				++nFailures;
+		}
+		else
+		{
+			const double dRelativeSpeed = dBaseline / dCost;
+			bool bPassed = dRelativeSpeed >= 1.0 - m_dGoldenMaxSlowdown;
+			SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "%s throughput: %.2f of baseline (cost %.2f, baseline %.2f), %.0f frames/s\n", bPassed ? "PASS" : "FAIL", dRelativeSpeed, dCost, dBaseline, dThroughput);
+			if (!bPassed)
+				++nFailures;
+		}
+	}
+
+	if (nFailures > 0)
+		return 1;
+	return bIsSkipped ? GOLDEN_SKIPPED : 0;
+}
+
+// Moves a finger or the mouse from one key to another (-1 for none). Keys sound while at least one pointer holds them, so dragging across keys plays a glissando.
+// Each manual plays on its own channel.
+void MovePointer(AudioEngine& engine, const int& nOldKey, const int& nNewKey)
+{
+	if (nOldKey == nNewKey)
+		return;
+
+	if (nOldKey != -1 && --m_nKeyHolds[nOldKey] == 0)
+	{
+		engine.NoteReleased(nOldKey / m_nNumOfKeys, KeyNote(nOldKey));
+		m_bIsKeyPressed[nOldKey] = false;
+	}
+
+	if (nNewKey != -1 && m_nKeyHolds[nNewKey]++ == 0)
+	{
+		engine.NoteTriggered(nNewKey / m_nNumOfKeys, KeyNote(nNewKey));
+		m_bIsKeyPressed[nNewKey] = true;
+	}
+}
+
+// Trace replay ------------------------------------------------------------
+// Rebuilds the engine from a trace written with --trace and renders the recorded callbacks back to back, feeding notes and
+// preset changes in at the frames they were recorded at, so the workload behind a dropout can be profiled offline. Once the
+// ring has wrapped, the replay starts from the patches in effect at the oldest record kept, without notes held before it.
+
+#define REPLAY_MAX_REPORTED_OVERRUNS 20
+
+std::string m_sTraceFile; // Record a trace of the session to this file.
+Uint32 m_nTraceCapacity = TRACE_DEFAULT_CAPACITY;
+std::string m_sReplayFile;
+
+int ReplayTrace(const char* sPath)
+{
+	std::vector<TraceRecord> setup, events;
+	Uint64 nDropped = 0;
+	if (!ReadTrace(sPath, setup, events, nDropped))
+		return 1;
+	if (nDropped > 0)
+		SDL_Log("Warning: %llu records were dropped while recording, the replay may differ", (unsigned long long)nDropped);
+
+	AudioEngine engine;
+	int nSampleRate = 44100, nChannels = 1, nVoiceBudget = 32;
+	unsigned int nQualityPreset = QUALITY_LIVE;
+	std::vector<std::array<double, PRESET_NUM_OF_FIELDS>> presets; // Per part.
+	std::vector<bool> bIsPresetChanged;
+
+	for (const auto& record : setup)
+	{
+		if (record.nType == TRACE_FORMAT)
+		{
+			nChannels = record.nChannel;
+			nSampleRate = record.nIndex;
+		}
+		else if (record.nType == TRACE_QUALITY)
+			nQualityPreset = record.nIndex;
+		else if (record.nType == TRACE_VOICE_BUDGET)
+			nVoiceBudget = record.nIndex;
+		else if (record.nType == TRACE_PART)
+		{
+			presets.push_back(std::array<double, PRESET_NUM_OF_FIELDS>());
+			engine.AddPart(record.nChannel, record.nIndex, (int)record.dValue).GetPresetFields(presets.back().data());
+			bIsPresetChanged.push_back(false);
+		}
+		else if (record.nType == TRACE_PARAMETER && record.nChannel >= 0 && record.nChannel < (int)presets.size() && record.nIndex >= 0 && record.nIndex < PRESET_NUM_OF_FIELDS)
+		{
+			presets[record.nChannel][record.nIndex] = record.dValue;
+			bIsPresetChanged[record.nChannel] = true;
+		}
+	}
+
+	// Allocate for the largest recorded block up front, like the live engine, so the timings are comparable.
+	int nMaxFrames = 1;
+	for (const auto& event : events)
+		if (event.nType == TRACE_CALLBACK)
+			nMaxFrames = SDL_max(nMaxFrames, event.nIndex);
+
+	engine.SetFormat(nSampleRate, nChannels);
+	engine.SetQualityPreset(nQualityPreset);
+	engine.SetVoiceBudget(nVoiceBudget);
+	engine.SetBlockSize(nMaxFrames);
+	nChannels = engine.GetChannels();
+
+	std::vector<Sint16> output(nMaxFrames * nChannels);
+	int nNumOfBlocks = 0, nNumOfOverruns = 0;
+	Uint64 nNumOfFrames = 0;
+	double dRecordedTime = 0.0, dReplayTime = 0.0, dWorstRecorded = 0.0, dWorstReplay = 0.0;
+	double dRecordedGainReduction = 0.0, dReplayGainReduction = 0.0;
+
+	for (const auto& event : events)
+	{
+		if (event.nType == TRACE_NOTE_ON)
+			engine.NoteTriggered(event.nChannel, event.nIndex);
+		else if (event.nType == TRACE_NOTE_OFF)
+			engine.NoteReleased(event.nChannel, event.nIndex);
+		else if (event.nType == TRACE_PARAMETER && event.nChannel >= 0 && event.nChannel < (int)presets.size() && event.nIndex >= 0 && event.nIndex < PRESET_NUM_OF_FIELDS)
+		{
+			presets[event.nChannel][event.nIndex] = event.dValue;
+			bIsPresetChanged[event.nChannel] = true;
+		}
+		else if (event.nType == TRACE_GAIN_REDUCTION)
+			dRecordedGainReduction = SDL_max(dRecordedGainReduction, event.dValue);
+		else if (event.nType == TRACE_CALLBACK && event.nIndex > 0)
+		{
+			// Presets switch at the start of a block, as they did when recorded.
+			for (int nPart = 0; nPart < (int)presets.size(); ++nPart)
+			{
+				if (bIsPresetChanged[nPart])
+				{
+					AudioWaveform::Preset* pPreset = AudioWaveform::CreatePreset(presets[nPart].data(), PRESET_NUM_OF_FIELDS);
+					if (pPreset != nullptr)
+						engine.ApplyPreset(nPart, pPreset);
+					bIsPresetChanged[nPart] = false;
+				}
+			}
+
+			const int nFrames = event.nIndex;
+			const Uint64 nStart = SDL_GetPerformanceCounter();
+			engine.Output.Process(engine.Render(nFrames), output.data(), nFrames);
+			const double dTime = (double)(SDL_GetPerformanceCounter() - nStart) / SDL_GetPerformanceFrequency();
+			dReplayGainReduction = SDL_max(dReplayGainReduction, engine.Output.GetBlockGainReduction());
+
+			const double dBudget = (double)nFrames / nSampleRate;
+			if (event.dValue > dBudget && nNumOfOverruns++ < REPLAY_MAX_REPORTED_OVERRUNS)
+				SDL_Log("Overrun in block %d at frame %llu: recorded %.3f ms, replayed %.3f ms, budget %.3f ms", nNumOfBlocks, (unsigned long long)event.nFrame, event.dValue * 1000.0, dTime * 1000.0, dBudget * 1000.0);
+
+			dRecordedTime += event.dValue;
+			dReplayTime += dTime;
+			dWorstRecorded = SDL_max(dWorstRecorded, event.dValue);
+			dWorstReplay = SDL_max(dWorstReplay, dTime);
+			nNumOfFrames += nFrames;
+			++nNumOfBlocks;
+		}
+	}
+
+	SDL_Log("Replayed %d blocks, %.1f s of audio, in %.3f s (%.1fx real time)", nNumOfBlocks, (double)nNumOfFrames / nSampleRate, dReplayTime, dReplayTime > 0.0 ? nNumOfFrames / (nSampleRate * dReplayTime) : 0.0);
+	SDL_Log("Callback time recorded: %.3f ms total, %.3f ms worst. Replayed: %.3f ms total, %.3f ms worst. %d blocks overran when recorded",
+		dRecordedTime * 1000.0, dWorstRecorded * 1000.0, dReplayTime * 1000.0, dWorstReplay * 1000.0, nNumOfOverruns);
+	SDL_Log("Peak output limiter gain reduction recorded: %.1f dB, replayed: %.1f dB", dRecordedGainReduction, dReplayGainReduction);
+	return 0;
+}
+
+std::string m_sPresetFile; // Loaded into the first part at start up. Presets can also be dropped on the window.
+std::string m_sSavePresetFile; // Write the default patch to this file and exit.
+
+// Loads a preset file and switches the first part to it without stopping the audio.
+void LoadPresetInto(AudioEngine& engine, const char* sPath)
+{
+	AudioWaveform::Preset* pPreset = AudioWaveform::LoadPreset(sPath);
+	if (pPreset != nullptr && engine.GetNumOfParts() > 0)
+	{
+		engine.ApplyPreset(0, pPreset);
+		SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Loaded preset %s\n", sPath);
+	}
+	else
+		delete pPreset;
+}
+
+void ParseArguments(int argc, char* args[])
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		if (SDL_strcmp(args[i], "--keys") == 0 && i + 1 < argc)
+			m_nNumOfKeys = SDL_max(1, SDL_min(SDL_atoi(args[++i]), MAX_NUM_OF_KEYS));
+		else if (SDL_strcmp(args[i], "--manuals") == 0 && i + 1 < argc)
+			m_nNumOfManuals = SDL_max(1, SDL_min(SDL_atoi(args[++i]), MAX_NUM_OF_MANUALS));
+		else if (SDL_strcmp(args[i], "--lowest") == 0 && i + 1 < argc)
+			m_nLowestNote = SDL_atoi(args[++i]);
+		else if (SDL_strcmp(args[i], "--channels") == 0 && i + 1 < argc)
+			m_nNumOfChannels = SDL_max(1, SDL_min(SDL_atoi(args[++i]), MAX_NUM_OF_CHANNELS));
+		else if (SDL_strcmp(args[i], "--voices") == 0 && i + 1 < argc)
+			m_nVoiceBudget = SDL_atoi(args[++i]);
+		else if (SDL_strcmp(args[i], "--layer") == 0)
+			m_bLayerPad = true;
+		else if (SDL_strcmp(args[i], "--split") == 0 && i + 1 < argc)
+		{
+			m_bSplitKeyboard = true;
+			m_nSplitNote = SDL_atoi(args[++i]);
+		}
+		else if (SDL_strcmp(args[i], "--trace") == 0 && i + 1 < argc)
+			m_sTraceFile = args[++i];
+		else if (SDL_strcmp(args[i], "--trace-size") == 0 && i + 1 < argc)
+			m_nTraceCapacity = (Uint32)SDL_max(1, SDL_atoi(args[++i]));
+		else if (SDL_strcmp(args[i], "--replay") == 0 && i + 1 < argc)
+			m_sReplayFile = args[++i];
+		else if (SDL_strcmp(args[i], "--preset") == 0 && i + 1 < argc)
+			m_sPresetFile = args[++i];
+		else if (SDL_strcmp(args[i], "--save-preset") == 0 && i + 1 < argc)
+			m_sSavePresetFile = args[++i];
+		else if (SDL_strcmp(args[i], "--golden-record") == 0 && i + 1 < argc)
+			m_sGoldenRecordDir = args[++i];
+		else if (SDL_strcmp(args[i], "--golden-check") == 0 && i + 1 < argc)
+			m_sGoldenCheckDir = args[++i];
+		else if (SDL_strcmp(args[i], "--baseline") == 0 && i + 1 < argc)
+			m_sGoldenBaseline = args[++i];
+		else if (SDL_strcmp(args[i], "--min-snr") == 0 && i + 1 < argc)
+			m_dGoldenMinSNR = SDL_atof(args[++i]);
+		else if (SDL_strcmp(args[i], "--max-peak-error") == 0 && i + 1 < argc)
+			m_dGoldenMaxPeakError = SDL_atof(args[++i]);
+		else if (SDL_strcmp(args[i], "--max-slowdown") == 0 && i + 1 < argc)
+			m_dGoldenMaxSlowdown = SDL_atof(args[++i]);
+		else if (SDL_strcmp(args[i], "--quality") == 0 && i + 1 < argc)
+		{
+			++i;
+			if (SDL_strcmp(args[i], "high") == 0)
+				m_nQualityPreset = QUALITY_HIGH;
+			else if (SDL_strcmp(args[i], "offline") == 0)
+				m_nQualityPreset = QUALITY_OFFLINE;
+			else
+				m_nQualityPreset = QUALITY_LIVE;
+		}
+		else
+			SDL_Log("Warning: Unknown argument %s", args[i]);
+	}
+}
+
+int main(int argc, char* args[])
+{
+	SDL_LogInfo(SDL_LOG_CATEGORY_APPLICATION, "Running...\n");
+
+	ParseArguments(argc, args);
+
+	if (!m_sGoldenRecordDir.empty())
+		return RunGoldenTests(m_sGoldenRecordDir, true);
+	if (!m_sGoldenCheckDir.empty())
+		return RunGoldenTests(m_sGoldenCheckDir, false);
+	if (!m_sReplayFile.empty())
+		return ReplayTrace(m_sReplayFile.c_str());
+	if (!m_sSavePresetFile.empty())
+		return AudioData().SavePreset(m_sSavePresetFile.c_str()) ? 0 : 1;
+
+	if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) < 0)
+		SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+	else
+	{
+		if (!SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "1"))
+		{
+			SDL_Log("Warning: Linear texture filtering not enabled!");
+		}
+#ifdef __ANDROID__
+		SDL_DisplayMode displayMode;
+		if (SDL_GetCurrentDisplayMode(0, &displayMode) == 0)		
+			window = SDL_CreateWindow("SDL Framework", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, displayMode.w, displayMode.h, SDL_WINDOW_SHOWN);
+		else
+			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Could not get display mode for video display #%d: %s", 0, SDL_GetError());
+#else
+		window = SDL_CreateWindow("SDL Framework", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1024, 576, SDL_WINDOW_SHOWN);
+#endif
+		if (window == nullptr)
+			SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Window could not be created! SDL_Error: %s\n", SDL_GetError());
+		else
+		{			
+            gRenderer = SDL_CreateRenderer( window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC );
+            if( gRenderer == NULL )
+                SDL_LogError(SDL_LOG_CATEGORY_VIDEO, "Renderer could not be created! SDL Error: %s\n", SDL_GetError() );
+			else      
+				SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0x00, 0xFF);
+
+			SDL_AudioSpec spec;
+			//SDL_AudioDeviceID device;
+			AudioEngine engine;
+
+			for (int nManual = 0; nManual < m_nNumOfManuals; ++nManual)
+			{
+				if (m_bSplitKeyboard)
+				{
+					SetPadPatch(engine.AddPart(nManual, INT_MIN, m_nSplitNote - 1));
+					engine.AddPart(nManual, m_nSplitNote);
+				}
+				else
+					engine.AddPart(nManual);
+
+				if (m_bLayerPad)
+					SetPadPatch(engine.AddPart(nManual));
+			}
+			engine.SetVoiceBudget(m_nVoiceBudget);
+
+			if (!m_sPresetFile.empty())
+				LoadPresetInto(engine, m_sPresetFile.c_str());
+
+			SDL_memset(&spec, 0, sizeof(spec));
+
+			spec.userdata = &engine;
+			spec.channels = m_nNumOfChannels;
+			spec.freq = 44100;
+			spec.format = AUDIO_S16SYS;
+			spec.samples = DEFAULT_BLOCK_SIZE;
+			spec.callback = MyAudioCallback;
+
+			engine.SetQualityPreset(m_nQualityPreset);
+
+			// Render at whatever rate and channel layout the device prefers instead of having SDL convert.
+			SDL_AudioSpec obtained;
+			device = SDL_OpenAudioDevice(NULL, 0, &spec, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE);
+
+			if (device == 0)
+				SDL_LogError(SDL_LOG_CATEGORY_AUDIO, "Could not open audio device %s\n", SDL_GetError());
+			else
+			{
+				engine.SetFormat(obtained.freq, obtained.channels);
+				engine.SetBlockSize(obtained.samples);
+				SDL_LogInfo(SDL_LOG_CATEGORY_AUDIO, "Audio device opened at %d Hz with %d channels\n", obtained.freq, obtained.channels);
+			}
+
+			TraceRecorder trace;
+			if (!m_sTraceFile.empty() && trace.Open(m_sTraceFile.c_str(), m_nTraceCapacity))
+			{
+				engine.SetTrace(&trace);
+				if (!trace.Start())
+					engine.SetTrace(nullptr);
+			}
+
+			SDL_PauseAudioDevice(device, 0);
+			// ----------------------------------------------------------------------
+			InitKeyboard();
+			CalculateLayout();
+			CreateKeyboardTexture();
+
+			if (DrawKeys())
+				SDL_RenderPresent(gRenderer);
+			// ----------------------------------------------------------------------
+
+			bool quit = false;
+			Uint32 nLastGainReductionLog = SDL_GetTicks();
+
+			SDL_Event e;
+#ifdef __EMSCRIPTEN__
+			std::function<void()> mainLoop = [&]() {
+#else
+			while (!quit) {
+				// Sleep until something happens instead of redrawing an idle keyboard every frame, waking up to report the limiter.
+				SDL_WaitEventTimeout(nullptr, GAIN_REDUCTION_LOG_INTERVAL);
+#endif
+				if (SDL_GetTicks() - nLastGainReductionLog >= GAIN_REDUCTION_LOG_INTERVAL)
+				{
+					double dGainReduction = engine.Output.TakeGainReduction();
+					if (dGainReduction > 0.0)
+						SDL_LogInfo(SDL_LOG_CATEGORY_AUDIO, "Output limiter gain reduction: %.1f dB\n", dGainReduction);
+					nLastGainReductionLog = SDL_GetTicks();
+				}
+
+				while (SDL_PollEvent(&e) != 0)
+				{
+					if (e.type == SDL_QUIT)
+						quit = true;
+					if (e.type == SDL_WINDOWEVENT)
+					{
+						if (e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)
+						{
+							CalculateLayout();
+							CreateKeyboardTexture();
+						}
+						else if (e.window.event == SDL_WINDOWEVENT_EXPOSED)
+							m_bRedrawKeyboard = true;
+					}
+					if (e.type == SDL_RENDER_TARGETS_RESET)
+						m_bRedrawKeyboard = true;
+					if (e.type == SDL_RENDER_DEVICE_RESET)
+						CreateKeyboardTexture();
+					if (e.type == SDL_DROPFILE)
+					{
+						LoadPresetInto(engine, e.drop.file);
+						SDL_free(e.drop.file);
+					}
+#ifdef __ANDROID__
+					if (e.type == SDL_FINGERDOWN || e.type == SDL_FINGERMOTION)
+					{
+						int width, height;
+						SDL_GetWindowSize(window, &width, &height);
+						int ht = HitTest((int)(e.tfinger.x * width), (int)(e.tfinger.y * height));
+
+						auto touch = touches.find(e.tfinger.fingerId);
+						if (touch == touches.end())
+							touch = touches.insert(std::make_pair(e.tfinger.fingerId, -1)).first;
+
+						MovePointer(engine, touch->second, ht);
+						touch->second = ht;
+					}
+					if (e.type == SDL_FINGERUP)
+					{
+						auto touch = touches.find(e.tfinger.fingerId);
+						if (touch != touches.end())
+						{
+							MovePointer(engine, touch->second, -1);
+							touches.erase(touch);
+						}
+					}
+#else
+					if (e.type == SDL_MOUSEBUTTONDOWN && e.button.button == SDL_BUTTON_LEFT)
+					{
+						int ht = HitTest(e.button.x, e.button.y);
+						MovePointer(engine, m_nMouseKey, ht);
+						m_nMouseKey = ht;
+					}
+					if (e.type == SDL_MOUSEMOTION && (e.motion.state & SDL_BUTTON_LMASK))
+					{
+						int ht = HitTest(e.motion.x, e.motion.y);
+						MovePointer(engine, m_nMouseKey, ht);
+						m_nMouseKey = ht;
+					}
+					if (e.type == SDL_MOUSEBUTTONUP && e.button.button == SDL_BUTTON_LEFT)
+					{
+						MovePointer(engine, m_nMouseKey, -1);
+						m_nMouseKey = -1;
+					}
+#endif
+				}
+				if (DrawKeys())
+					SDL_RenderPresent(gRenderer);
 
 			}
 #ifdef __EMSCRIPTEN__
 			; emscripten_set_main_loop_arg(dispatch_main, &mainLoop, 0, 1);
 #endif
+			SDL_LogInfo(SDL_LOG_CATEGORY_AUDIO, "Output limiter gain reduction since the last report: %.1f dB\n", engine.Output.TakeGainReduction());
+			// Stop the callback before the engine and any presets it still holds go away.
+			SDL_CloseAudioDevice(device);
+			trace.Close();
 		}
 	}
 
+	if (m_KeyboardTexture != nullptr)
+		SDL_DestroyTexture(m_KeyboardTexture);
+	SDL_DestroyRenderer(gRenderer);
 	SDL_DestroyWindow(window);
 	SDL_Quit();
 